@@ -0,0 +1,61 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+import os
+
+
+def parse_cpus(cpus):
+    """Parse CPU list in the taskset format, e.g. "0-3,6"."""
+    result = set()
+    for part in cpus.split(","):
+        part = part.strip()
+        if not part:
+            continue
+        first, _, last = part.partition("-")
+        result.update(range(int(first), int(last or first) + 1))
+    if not result:
+        raise ValueError(f"Invalid CPU list: '{cpus}'")
+    return result
+
+
+def format_cpus(cpus):
+    return ",".join(str(cpu) for cpu in sorted(cpus))
+
+
+def pin_process(cpus):
+    """
+    Pin all threads of the current process to the CPUs. Threads created later
+    (e.g. by Renode when the emulation starts) inherit the affinity of their creator.
+    """
+    for tid in os.listdir("/proc/self/task"):
+        try:
+            os.sched_setaffinity(int(tid), cpus)
+        except ProcessLookupError:
+            pass
+    logging.info(f"Process pinned to CPUs {format_cpus(cpus)}")
+
+
+def pinned_command(command, cpus):
+    """Prefix the shell command, so all processes it starts run on the CPUs."""
+    return f"taskset -c {format_cpus(cpus)} {command}"
+
+
+def partition_cpus(sim_cpus=None, build_cpus=None):
+    """
+    Return CPU sets for simulations and builds. When only one of them is given,
+    the other one consists of the remaining CPUs available to the process.
+    """
+    sim_cpus = parse_cpus(sim_cpus) if sim_cpus else None
+    build_cpus = parse_cpus(build_cpus) if build_cpus else None
+    if sim_cpus and not build_cpus:
+        build_cpus = os.sched_getaffinity(0) - sim_cpus or None
+        if build_cpus is None:
+            logging.warning("No CPUs left for builds, they share CPUs with simulations")
+    elif build_cpus and not sim_cpus:
+        sim_cpus = os.sched_getaffinity(0) - build_cpus or None
+        if sim_cpus is None:
+            logging.warning("No CPUs left for simulations, they share CPUs with builds")
+    if sim_cpus and build_cpus and sim_cpus & build_cpus:
+        logging.warning(f"CPUs {format_cpus(sim_cpus & build_cpus)} are used both by simulations and builds")
+    return sim_cpus, build_cpus
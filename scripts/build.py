@@ -3,18 +3,37 @@
 
 import asyncio
 import contextlib
+import functools
 import json
 import logging
 import os
 import re
 import shutil
+import signal
 import sys
 import yaml
 
 from pathlib import Path
-
+from typing import List
+
+from .build_db import (
+    BuildDatabase,
+    async_workspace_lock,
+    collect_build_inputs,
+    git_revision,
+    publish_dir,
+    staging_dir,
+    toolchain_id,
+    workspace_lock,
+    zephyr_revision_dir,
+)
+from .cpu_load import THREAD_STATS_CONFIGS
+from .affinity import parse_cpus, pinned_command
 from .parse_graph import Graph
+from .priority import registered_job, throttle_command
+from .scratch import ScratchSpace
 from .specification import Specification
+from .workspace_gc import parse_size
 
 
 def _prep_kconfig_board(configs):
@@ -68,7 +87,15 @@ def _enable_iface(interface):
     return snippet
 
 
-def _prep_leds(leds):
+_LED_TEMPLATE = (
+    "\t\t{label}: led_{index} {{\n"
+    "\t\t\tgpios = <&{soc_if} {addr} GPIO_ACTIVE_HIGH>;\n"
+    '\t\t\tlabel = "{name}";\n'
+    "\t\t}};\n"
+)
+
+
+def _prep_leds(leds, instances=()):
     snippet = "#include <zephyr/dt-bindings/gpio/gpio.h>\n"
     snippet += "/ {\n"
     snippet += "\tleds {\n"
@@ -84,12 +111,17 @@ def _prep_leds(leds):
             logging.warning(f"Can't find address for node {node.name}. Skipping node.")
             continue
         label = node.label
-        snippet += f"\t\t{label}: led_{i} {{\n"
-        snippet += f"\t\t\tgpios = <&{soc_if} {addr} GPIO_ACTIVE_HIGH>;\n"
-        snippet += f'\t\t\tlabel = "{name}";\n'
-        snippet += "\t\t};\n"
+        snippet += _LED_TEMPLATE.format(label=label, index=i, soc_if=soc_if, addr=addr, name=name)
         used_interfaces.add(soc_if)
 
+    index = len(leds)
+    for instance, ports in instances:
+        for fragment in _subgraph_fragments(instance.subgraph):
+            if fragment.kind == 'led' and fragment.port in ports:
+                snippet += fragment.instantiate(instance, ports, index)
+                used_interfaces.add(ports[fragment.port])
+                index += 1
+
     snippet += "\t};\n"
     snippet += "};\n"
 
@@ -99,29 +131,34 @@ def _prep_leds(leds):
     return snippet
 
 
-def _create_connection_snippet(name, label, addr, compats, soc_if, sensor_type):
-    address = f"@{addr:x}" if addr else ""
-
-    snippet = f"&{soc_if} " + "{\n"
+@functools.lru_cache(maxsize=None)
+def _connection_template(with_addr, with_compats, with_sensor_type):
+    snippet = "&{soc_if} {{\n"
     snippet += '\tstatus = "okay";\n'
-    snippet += f"\t{label}: {name}" + address + " {\n"
+    snippet += "\t{label}: {name}" + ("@{addr:x}" if with_addr else "") + " {{\n"
 
-    if compats:
-        snippet += f'\t\tcompatible = {compats};\n'
+    if with_compats:
+        snippet += '\t\tcompatible = {compats};\n'
 
-    if addr:
-        snippet += f"\t\treg = <{addr:#x}>;\n"
+    if with_addr:
+        snippet += "\t\treg = <{addr:#x}>;\n"
 
-    if sensor_type:
-        snippet += f'\t\tfriendly-name = "{sensor_type}";\n'
+    if with_sensor_type:
+        snippet += '\t\tfriendly-name = "{sensor_type}";\n'
 
     snippet += '\t\tstatus = "okay";\n'
-    snippet += "\t};\n"
-    snippet += "};\n"
+    snippet += "\t}};\n"
+    snippet += "}};\n"
     return snippet
 
 
-def _prep_thermometers(thermometers):
+def _create_connection_snippet(name, label, addr, compats, soc_if, sensor_type):
+    template = _connection_template(bool(addr), bool(compats), bool(sensor_type))
+    return template.format(name=name, label=label, addr=addr, compats=compats, soc_if=soc_if,
+                           sensor_type=sensor_type)
+
+
+def _prep_thermometers(thermometers, instances=()):
     snippet = ""
     for (i, (soc_if, node_if, temp)) in enumerate(thermometers):
         name = temp.rdp_name if temp.rdp_name else temp.name
@@ -134,10 +171,66 @@ def _prep_thermometers(thermometers):
 
         snippet += _create_connection_snippet(name, label, addr, compats, soc_if, 'thermometer')
 
+    for instance, ports in instances:
+        for fragment in _subgraph_fragments(instance.subgraph):
+            if fragment.kind == 'thermometer' and fragment.port in ports:
+                snippet += fragment.instantiate(instance, ports)
+
     return snippet
 
 
-def prepare_zephyr_board_dir(board_name, soc_name, connections, workspace):
+class _Fragment():
+    """Devicetree snippet of a subgraph node, with the SoC interface, label and address left to fill in."""
+    def __init__(self, kind, port, template, addr, fields):
+        self.kind = kind
+        self.port = port
+        self.template = template
+        self.addr = addr
+        self.fields = fields
+
+    def instantiate(self, instance, ports, index=None):
+        addr = self.addr + instance.address_offset if self.addr is not None else None
+        return self.template.format(
+            soc_if=ports[self.port], label=f"{self.fields['label']}_{instance.suffix}",
+            addr=addr, index=index, **{k: v for k, v in self.fields.items() if k != 'label'}
+        )
+
+
+def _subgraph_fragments(subgraph):
+    """
+    Generate snippets of the subgraph nodes once, for all its instances in all graphs.
+    They are stored in the subgraph, so they are released together with it.
+    """
+    if subgraph.fragments is not None:
+        return subgraph.fragments
+    fragments = []
+    for port, node, node_if in subgraph.ports:
+        if node.category.startswith("IO/LED"):
+            addr = node.get_node_interface_address('gpio')
+            if addr is None:
+                logging.warning(f"Can't find address for node {node.name} of {subgraph.name}. Skipping node.")
+                continue
+            fields = {'label': node.label, 'name': node.name or "LED"}
+            fragments.append(_Fragment('led', port, _LED_TEMPLATE, addr, fields))
+        elif node.is_thermometer():
+            addr = node.get_node_interface_address(node_if)
+            compats = node.get_compats()
+            fields = {
+                'label': node.label,
+                'name': node.rdp_name or node.name,
+                'compats': compats,
+                'sensor_type': 'thermometer',
+            }
+            template = _connection_template(bool(addr), bool(compats), True)
+            fragments.append(_Fragment('thermometer', port, template, addr or None, fields))
+        else:
+            logging.warning(f"Node {node.name} of {subgraph.name} is currently not supported!")
+    subgraph.fragments = fragments
+    return fragments
+
+
+def prepare_zephyr_board_dir(board_name, soc_name, connections, workspace, graph_fingerprint=None,
+                             instances=()):
     zephyr_base = Path(os.environ.get('ZEPHYR_BASE'))
     socs_dir = workspace / "visual-system-designer-resources/zephyr-data/socs"
 
@@ -146,12 +239,11 @@ def prepare_zephyr_board_dir(board_name, soc_name, connections, workspace):
         configs = yaml.safe_load(f)
 
     arch = configs["architecture"]
-    board_dir = workspace / "boards" / arch / board_name
-
-    # Remove old directory for board of the same name
-    if board_dir.exists():
-        shutil.rmtree(board_dir)
 
+    # The board is generated aside and swapped in when it's complete, so builds
+    # using the previous version of the board never see a partially written one
+    staging = staging_dir(workspace, board_name)
+    board_dir = staging / board_name
     os.makedirs(board_dir)
 
     # XXX: This is the place to implement adding things to devicetree and configs
@@ -182,7 +274,7 @@ def prepare_zephyr_board_dir(board_name, soc_name, connections, workspace):
 
             thermometers, connections = _filter_nodes(
                 connections,
-                lambda node: node.rdp_name in ['ti_tmp108', 'silabs_si7210']
+                lambda node: node.is_thermometer()
             )
 
             if len(connections) > 0:
@@ -192,41 +284,48 @@ def prepare_zephyr_board_dir(board_name, soc_name, connections, workspace):
 
             output.write("\n\n// nodes from graph\n\n")
 
-            output.write(_prep_leds(leds))
-            output.write(_prep_thermometers(thermometers))
+            output.write(_prep_leds(leds, instances))
+            output.write(_prep_thermometers(thermometers, instances))
 
     if "additional_files" in configs:
         for file in configs["additional_files"]:
             shutil.copy2(zephyr_base / file, board_dir)
 
+    with workspace_lock(workspace, f"board-{board_name}"):
+        board_dir = publish_dir(board_dir, workspace / "boards" / arch / board_name)
+        db = BuildDatabase(workspace)
+        db.record_board(board_name, soc_name, graph_fingerprint)
+        db.close()
+    shutil.rmtree(staging)
+
     return board_dir
 
 
+BUILD_ARTIFACTS = [
+    "zephyr/zephyr.dts",
+    "zephyr/zephyr.elf",
+    "zephyr/.config",
+    "build.log",
+]
+
+
 def _copy_build_images(board_name, build_dir, dst_dir):
-    # Remove builds directory to discard old build artifacts
-    if dst_dir.exists():
-        shutil.rmtree(dst_dir)
-
-    os.makedirs(dst_dir)
-    copy_files = [
-        (build_dir / "zephyr/zephyr.dts", dst_dir / "zephyr/zephyr.dts"),
-        (build_dir / "zephyr/zephyr.elf", dst_dir / "zephyr/zephyr.elf"),
-        (build_dir / "zephyr/.config", dst_dir / "zephyr/.config"),
-        (build_dir / "build.log", dst_dir / "build.log"),
-    ]
-    for src, dest in copy_files:
+    for artifact in BUILD_ARTIFACTS:
+        src, dest = build_dir / artifact, dst_dir / artifact
         if src.exists():
             os.makedirs(dest.parent, exist_ok=True)
             shutil.copy(src, dest)
 
 
-def compose_west_command(board_name, app_path, build_dir, boards_dir):
-    cmd = "west build -p"
+def compose_west_command(board_name, app_path, build_dir, boards_dir, extra_configs=None, pristine=True):
+    cmd = "west build -p" if pristine else "west build -p auto"
     cmd += f" -b {board_name}"
     cmd += f" --build-dir {build_dir}"
     cmd += f" {app_path}"
     cmd += " --"
     cmd += f" -DBOARD_ROOT={boards_dir.absolute()}"
+    for name, value in (extra_configs or {}).items():
+        cmd += f" -D{name}={value}"
     return cmd
 
 
@@ -249,7 +348,8 @@ def prepare_zephyr_board(graph_file: Path,
     board_name = re.sub('\s', '_', graph.name)
     logging.info(f"Creating zephyr board named '{board_name}'")
 
-    board_dir = prepare_zephyr_board_dir(board_name, soc_name, connections, workspace)
+    board_dir = prepare_zephyr_board_dir(board_name, soc_name, connections, workspace, graph.fingerprint,
+                                         graph.get_instance_connections())
     if not board_dir:
         sys.exit(1)
     logging.info(f"Created board configuration in {board_dir}")
@@ -258,42 +358,77 @@ def prepare_zephyr_board(graph_file: Path,
 def build_zephyr(board_name: str,
                  app_path: Path = Path("demo/blinky-temperature"),
                  workspace: Path = Path("workspace"),
-                 quiet: bool = False):
-
-    async def aprint(msg):
-        print(msg, end='')
-
-    return asyncio.run(
-        build_zephyr_async(
-            board_name,
-            aprint if not quiet else None,
-            None,
-            app_path,
-            workspace
-        )
-    )
-
-
-async def build_zephyr_async(board_name: str,
-                             print_callback,
-                             kill_event,
-                             app_path: Path = Path("demo/blinky-temperature"),
-                             workspace: Path = Path("workspace")):
-    build_dir = workspace / 'build'
-
-    # Remove build directory to discard old build files
-    if build_dir.exists():
-        shutil.rmtree(build_dir)
-
-    os.makedirs(build_dir)
-    command = compose_west_command(board_name, app_path, build_dir, workspace)
-
+                 quiet: bool = False,
+                 thread_stats: bool = False,
+                 executors: str = None,
+                 zephyr_revision: List[str] = None,
+                 scratch_dir: Path = None,
+                 scratch_budget: str = None,
+                 priority: str = None,
+                 cpus: str = None):
+    """
+    Build Zephyr for the board. With --thread-stats, the firmware prints
+    runtime statistics of its threads, which are reported by `simulate --cpu-load`.
+    With --executors, the build runs on one of the given executors (see README).
+    Builds for many --zephyr-revision options run in parallel.
+    With --scratch-dir (e.g. on tmpfs), build trees are kept there and saved
+    in the workspace in the background.
+    With --priority (interactive, speculative, batch), the build runs with
+    lower CPU and I/O priority and can be paused by interactive builds.
+    With --cpus (e.g. 4-7), the build runs only on the given CPUs.
+    """
+    from .executors import parse_executors
+
+    def printer(prefix):
+        async def aprint(msg):
+            if msg:
+                print(f"{prefix}{msg}", end='')
+        return aprint if not quiet else None
+
+    scratch = ScratchSpace(workspace, scratch_dir, parse_size(scratch_budget) if scratch_budget else None) \
+        if scratch_dir else None
+
+    async def build_all():
+        pool = parse_executors(executors) if executors else None
+        revisions = zephyr_revision or [None]
+        return await asyncio.gather(*(
+            build_zephyr_async(
+                board_name,
+                printer(f"[{revision}] " if len(revisions) > 1 else ""),
+                None,
+                app_path,
+                workspace,
+                THREAD_STATS_CONFIGS if thread_stats else None,
+                pool,
+                revision,
+                scratch=scratch,
+                priority=priority,
+                cpus=parse_cpus(cpus) if cpus else None
+            ) for revision in revisions
+        ))
+
+    results = asyncio.run(build_all())
+    if scratch:
+        scratch.close()
+    return results[0] if len(results) == 1 else results
+
+
+async def _run_local_build(command, print_callback, kill_event, env=None, cwd=None, register=None):
+    # Registered builds run in their own process group, which can be paused as a whole
     proc = await asyncio.create_subprocess_shell(
         command,
         stdout=asyncio.subprocess.PIPE,
-        stderr=asyncio.subprocess.STDOUT
+        stderr=asyncio.subprocess.STDOUT,
+        env=env,
+        cwd=cwd,
+        start_new_session=register is not None
     )
 
+    with register(proc.pid) if register else contextlib.nullcontext():
+        return await _wait_for_build(proc, print_callback, kill_event, register is not None)
+
+
+async def _wait_for_build(proc, print_callback, kill_event, group):
     out = bytearray()
 
     # XXX: There is no .poll() method in asyncio.subprocess so we have to do it manually.
@@ -302,24 +437,185 @@ async def build_zephyr_async(board_name: str,
             await asyncio.wait_for(p.wait(), 1e-6)
         return p.returncode is None
 
-    while await is_running(proc):
-        if kill_event and kill_event.is_set():
-            proc.terminate()
-            logging.warning("Aborting Zephyr build")
-            break
-
-        line = await proc.stdout.readline()
-        out.extend(line)
-        if print_callback:
-            await print_callback(line.decode())
+    aborted = False
+    try:
+        while await is_running(proc):
+            if kill_event and kill_event.is_set():
+                _terminate_build(proc, group)
+                logging.warning("Aborting Zephyr build")
+                aborted = True
+                break
+
+            line = await proc.stdout.readline()
+            out.extend(line)
+            if print_callback:
+                await print_callback(line.decode())
+    except BaseException:
+        # Builds in their own session don't get signals sent to VSD (e.g. Ctrl+C)
+        # and would be left running when the task is cancelled
+        _terminate_build(proc, group)
+        raise
 
     await proc.wait()
+    return proc.returncode, out, aborted
 
-    output_dir = workspace / 'builds' / board_name
-    _copy_build_images(board_name, build_dir, output_dir)
 
-    with open(output_dir / "build.log", "wb") as f:
-        f.write(out)
+def _terminate_build(proc, group):
+    with contextlib.suppress(ProcessLookupError):
+        if group:
+            os.killpg(proc.pid, signal.SIGTERM)
+            # The build could be paused by a job of higher priority
+            os.killpg(proc.pid, signal.SIGCONT)
+        else:
+            proc.terminate()
+
+
+async def build_zephyr_async(board_name: str,
+                             print_callback,
+                             kill_event,
+                             app_path: Path = Path("demo/blinky-temperature"),
+                             workspace: Path = Path("workspace"),
+                             extra_configs=None,
+                             executors=None,
+                             zephyr_revision=None,
+                             build_dir=None,
+                             scratch=None,
+                             priority=None,
+                             preempt="none",
+                             cpus=None,
+                             graph_fingerprint=None):
+    """
+    Build Zephyr for the board. When the pool of executors is given, the build is
+    dispatched to one of them instead of running in the workspace. `build_dir`
+    overrides the default build directory (`workspace/build-<board_name>`).
+
+    With `zephyr_revision`, the build uses the additional Zephyr revision set up
+    in the workspace and its results are saved as `<board_name>@<revision>`, so
+    builds for different revisions don't overwrite each other.
+
+    With `scratch` (ScratchSpace), local builds use build trees in the scratch
+    directory and reuse them when possible.
+
+    With `priority` class, local builds are throttled accordingly and registered
+    in the workspace jobs, `preempt` ("pause" or "cancel") is applied to jobs
+    of lower priority for the duration of the build. With `cpus` set, local
+    builds run only on these CPUs.
+
+    With `graph_fingerprint`, the build fails if the board was meanwhile
+    regenerated from another graph (e.g. one with the same name).
+    """
+    output_dir = workspace / 'builds' / board_name
+    env, cwd = None, None
+    zephyr_base = os.environ.get('ZEPHYR_BASE')
+
+    if zephyr_revision:
+        revision_dir = zephyr_revision_dir(workspace, zephyr_revision)
+        output_dir = workspace / 'builds' / f"{board_name}@{zephyr_revision}"
+        if not (revision_dir / 'zephyr').exists():
+            logging.error(f"Zephyr {zephyr_revision} isn't available in {revision_dir}, "
+                          "add it to ZEPHYR_REVISIONS and run setup.sh")
+            return 1, output_dir
+        zephyr_base = revision_dir / 'zephyr'
+        # west finds its workspace from the working directory, so all paths must be absolute
+        env = dict(os.environ, ZEPHYR_BASE=str(zephyr_base))
+        cwd = revision_dir
+        app_path = app_path.absolute()
+
+    if build_dir:
+        scratch = None
+    elif scratch:
+        build_dir = scratch.build_dir(output_dir.name)
+    else:
+        build_dir = workspace / f'build-{output_dir.name}'
+    if zephyr_revision:
+        build_dir = build_dir.absolute()
+
+    # The board can't be regenerated during the build, and builds with the same
+    # results directory (and build directory) have to wait for each other
+    async with async_workspace_lock(workspace, f"board-{board_name}", shared=True), \
+               async_workspace_lock(workspace, f"build-{output_dir.name}"):
+        db = BuildDatabase(workspace)
+        board = db.get_board(board_name)
+        if graph_fingerprint and (not board or board["graph_fingerprint"] != graph_fingerprint):
+            logging.error(f"Board {board_name} was regenerated from another graph, prepare it again")
+            db.close()
+            return 1, output_dir
+
+        build_id = db.start_build(
+            board_name,
+            collect_build_inputs(board_name, app_path, workspace, extra_configs, zephyr_base),
+            app_path=app_path.absolute(),
+            app_revision=git_revision(app_path),
+            zephyr_revision=git_revision(zephyr_base) if zephyr_base else None,
+            toolchain=toolchain_id(),
+        )
+        # Builds interrupted by an error or cancellation are recorded as failed
+        status, published = 'failed', False
+        staging = None
+        try:
+            # New artifacts are collected aside and replace the old ones when the build finishes
+            staging = staging_dir(workspace, output_dir.name)
+            artifacts_dir = staging / output_dir.name
+            os.makedirs(artifacts_dir)
+
+            if executors:
+                board_dirs = list((workspace / "boards").glob(f"*/{board_name}"))
+                if not board_dirs:
+                    logging.error(f"Board {board_name} wasn't prepared in {workspace}")
+                    return 1, output_dir
+
+                # Acquiring fails when none of the executors is available
+                executor = await executors.acquire()
+                try:
+                    logging.info(f"Building {board_name} on executor {executor.name}")
+                    with db.lease(output_dir):
+                        returncode, out, aborted = await executor.build(
+                            board_name, board_dirs[0], app_path, workspace, artifacts_dir,
+                            extra_configs, print_callback, kill_event, zephyr_revision
+                        )
+                finally:
+                    await executors.release(executor)
+            else:
+                # Build trees in the scratch space are kept between builds, west
+                # checks if they have to be rebuilt from scratch
+                warm = scratch is not None and await asyncio.to_thread(scratch.restore, output_dir.name)
+                if not warm:
+                    # Remove build directory to discard old build files
+                    if build_dir.exists():
+                        shutil.rmtree(build_dir)
+                    os.makedirs(build_dir)
+
+                command = compose_west_command(board_name, app_path, build_dir, workspace, extra_configs, pristine=not warm)
+                register = None
+                if priority:
+                    command = throttle_command(command, priority)
+                    register = lambda pid: registered_job(workspace, priority, pid, group=True,
+                                                          board=board_name, preempt=preempt)
+                if cpus:
+                    command = pinned_command(command, cpus)
+
+                with db.lease(build_dir):
+                    returncode, out, aborted = await _run_local_build(command, print_callback, kill_event, env, cwd, register)
+                    _copy_build_images(board_name, build_dir, artifacts_dir)
+                if scratch:
+                    scratch.built(output_dir.name)
+
+            with open(artifacts_dir / "build.log", "wb") as f:
+                f.write(out)
+
+            publish_dir(artifacts_dir, output_dir)
+            published = True
+
+            if aborted:
+                status = 'aborted'
+            else:
+                status = 'success' if returncode == 0 else 'failed'
+        finally:
+            if staging:
+                shutil.rmtree(staging, ignore_errors=True)
+            artifacts = [(a, output_dir / a) for a in BUILD_ARTIFACTS] if published else ()
+            db.finish_build(build_id, status, output_dir if published else None, artifacts)
+            db.close()
 
     logging.info(f"Build files saved in {output_dir}")
-    return proc.returncode, output_dir
+    return returncode, output_dir
@@ -0,0 +1,472 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import asyncio
+import contextlib
+import ctypes
+import errno
+import fcntl
+import hashlib
+import json
+import logging
+import os
+import shutil
+import sqlite3
+import subprocess
+import tempfile
+import time
+
+from pathlib import Path
+
+
+_SCHEMA = """
+CREATE TABLE IF NOT EXISTS boards (
+    board_name TEXT PRIMARY KEY,
+    soc_name TEXT NOT NULL,
+    graph_fingerprint TEXT,
+    created REAL NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS builds (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    board_name TEXT NOT NULL,
+    soc_name TEXT,
+    graph_fingerprint TEXT,
+    app_path TEXT,
+    app_revision TEXT,
+    zephyr_revision TEXT,
+    toolchain TEXT,
+    cache_key TEXT,
+    status TEXT NOT NULL,
+    started REAL NOT NULL,
+    finished REAL,
+    duration REAL,
+    output_dir TEXT
+);
+
+CREATE TABLE IF NOT EXISTS inputs (
+    build_id INTEGER NOT NULL REFERENCES builds(id) ON DELETE CASCADE,
+    name TEXT NOT NULL,
+    fingerprint TEXT NOT NULL,
+    PRIMARY KEY (build_id, name)
+);
+
+CREATE TABLE IF NOT EXISTS artifacts (
+    build_id INTEGER NOT NULL REFERENCES builds(id) ON DELETE CASCADE,
+    name TEXT NOT NULL,
+    path TEXT NOT NULL,
+    size INTEGER NOT NULL,
+    sha256 TEXT NOT NULL,
+    PRIMARY KEY (build_id, name)
+);
+
+CREATE TABLE IF NOT EXISTS usage (
+    path TEXT PRIMARY KEY,
+    last_used REAL NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS leases (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    path TEXT NOT NULL,
+    pid INTEGER NOT NULL,
+    created REAL NOT NULL
+);
+
+CREATE INDEX IF NOT EXISTS builds_graph_idx ON builds(graph_fingerprint, status, finished);
+CREATE INDEX IF NOT EXISTS builds_soc_idx ON builds(soc_name, finished);
+CREATE INDEX IF NOT EXISTS builds_board_idx ON builds(board_name, finished);
+CREATE INDEX IF NOT EXISTS builds_cache_key_idx ON builds(cache_key, status);
+CREATE INDEX IF NOT EXISTS artifacts_sha_idx ON artifacts(sha256);
+CREATE INDEX IF NOT EXISTS builds_output_idx ON builds(output_dir, finished);
+"""
+
+
+def file_digest(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 16), b""):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def fingerprint_dir(path, exclude=()):
+    """Hash relative paths and contents of all files in the directory tree."""
+    path = Path(path)
+    h = hashlib.sha256()
+    if not path.exists():
+        return h.hexdigest()
+
+    for root, dirs, files in os.walk(path):
+        dirs[:] = sorted(d for d in dirs if d not in exclude)
+        for name in sorted(files):
+            file = Path(root) / name
+            h.update(str(file.relative_to(path)).encode())
+            h.update(file_digest(file).encode())
+    return h.hexdigest()
+
+
+def git_revision(path):
+    try:
+        return subprocess.run(
+            ["git", "-C", str(path), "rev-parse", "HEAD"],
+            capture_output=True, check=True, text=True
+        ).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def toolchain_id():
+    sdk_dir = os.environ.get("ZEPHYR_SDK_INSTALL_DIR")
+    if not sdk_dir:
+        return None
+    version_file = Path(sdk_dir) / "sdk_version"
+    if version_file.exists():
+        return f"zephyr-sdk-{version_file.read_text().strip()}"
+    return sdk_dir
+
+
+def cache_key(inputs):
+    h = hashlib.sha256()
+    for name, fingerprint in sorted(inputs.items()):
+        h.update(f"{name}={fingerprint}\n".encode())
+    return h.hexdigest()
+
+
+class BuildDatabase():
+    """
+    Index of builds done in the workspace kept in SQLite database.
+
+    Every method commits its changes in a single transaction, so the database
+    stays consistent even if the build process is interrupted.
+    """
+    def __init__(self, workspace):
+        self.path = Path(workspace) / "builds.db"
+        os.makedirs(self.path.parent, exist_ok=True)
+        self._conn = sqlite3.connect(self.path, timeout=30)
+        self._conn.row_factory = sqlite3.Row
+        self._conn.execute("PRAGMA journal_mode=WAL")
+        self._conn.execute("PRAGMA foreign_keys=ON")
+        with self._conn:
+            self._conn.executescript(_SCHEMA)
+
+    def close(self):
+        self._conn.close()
+
+    def record_board(self, board_name, soc_name, graph_fingerprint=None):
+        with self._conn:
+            self._conn.execute(
+                "INSERT OR REPLACE INTO boards VALUES (?, ?, ?, ?)",
+                (board_name, soc_name, graph_fingerprint, time.time())
+            )
+
+    def get_board(self, board_name):
+        return self._conn.execute(
+            "SELECT * FROM boards WHERE board_name = ?", (board_name,)
+        ).fetchone()
+
+    def start_build(self, board_name, inputs, app_path=None, app_revision=None,
+                    zephyr_revision=None, toolchain=None):
+        board = self.get_board(board_name)
+        soc_name = board["soc_name"] if board else None
+        graph_fingerprint = board["graph_fingerprint"] if board else None
+
+        with self._conn:
+            cur = self._conn.execute(
+                """
+                INSERT INTO builds (board_name, soc_name, graph_fingerprint, app_path,
+                                    app_revision, zephyr_revision, toolchain, cache_key,
+                                    status, started)
+                VALUES (?, ?, ?, ?, ?, ?, ?, ?, 'running', ?)
+                """,
+                (board_name, soc_name, graph_fingerprint, str(app_path) if app_path else None,
+                 app_revision, zephyr_revision, toolchain, cache_key(inputs), time.time())
+            )
+            build_id = cur.lastrowid
+            self._conn.executemany(
+                "INSERT INTO inputs VALUES (?, ?, ?)",
+                [(build_id, name, fp) for name, fp in inputs.items()]
+            )
+        return build_id
+
+    def finish_build(self, build_id, status, output_dir=None, artifacts=()):
+        """
+        Mark build as finished and store the list of its artifacts.
+        Artifacts are given as (name, path) pairs; paths that don't exist are skipped.
+        """
+        rows = []
+        for name, path in artifacts:
+            path = Path(path)
+            if path.exists():
+                rows.append((build_id, name, str(path), path.stat().st_size, file_digest(path)))
+
+        finished = time.time()
+        with self._conn:
+            self._conn.execute(
+                """
+                UPDATE builds SET status = ?, finished = ?, duration = ? - started, output_dir = ?
+                WHERE id = ?
+                """,
+                (status, finished, finished, str(Path(output_dir).absolute()) if output_dir else None, build_id)
+            )
+            self._conn.executemany("INSERT OR REPLACE INTO artifacts VALUES (?, ?, ?, ?, ?)", rows)
+
+    def get_build(self, build_id):
+        return self._conn.execute("SELECT * FROM builds WHERE id = ?", (build_id,)).fetchone()
+
+    def get_artifacts(self, build_id):
+        return self._conn.execute(
+            "SELECT * FROM artifacts WHERE build_id = ? ORDER BY name", (build_id,)
+        ).fetchall()
+
+    def get_inputs(self, build_id):
+        rows = self._conn.execute("SELECT name, fingerprint FROM inputs WHERE build_id = ?", (build_id,))
+        return {row["name"]: row["fingerprint"] for row in rows}
+
+    def last_good_build(self, graph_fingerprint):
+        return self._conn.execute(
+            """
+            SELECT * FROM builds WHERE graph_fingerprint = ? AND status = 'success'
+            ORDER BY finished DESC LIMIT 1
+            """,
+            (graph_fingerprint,)
+        ).fetchone()
+
+    def find_by_cache_key(self, key):
+        return self._conn.execute(
+            """
+            SELECT * FROM builds WHERE cache_key = ? AND status = 'success'
+            ORDER BY finished DESC LIMIT 1
+            """,
+            (key,)
+        ).fetchone()
+
+    def builds_using_soc(self, soc_name):
+        return self._conn.execute(
+            "SELECT * FROM builds WHERE soc_name = ? ORDER BY started DESC", (soc_name,)
+        ).fetchall()
+
+    def find_builds(self, board_name=None, soc_name=None, graph_fingerprint=None, limit=20):
+        """Return the latest builds matching all given filters."""
+        filters = [("board_name", board_name), ("soc_name", soc_name), ("graph_fingerprint", graph_fingerprint)]
+        filters = [(column, value) for column, value in filters if value is not None]
+        where = " AND ".join(f"{column} = ?" for column, _ in filters) or "1"
+        return self._conn.execute(
+            f"SELECT * FROM builds WHERE {where} ORDER BY started DESC LIMIT ?",
+            (*(value for _, value in filters), limit)
+        ).fetchall()
+
+    def history(self, board_name=None, limit=20):
+        if board_name:
+            query = "SELECT * FROM builds WHERE board_name = ? ORDER BY started DESC LIMIT ?"
+            args = (board_name, limit)
+        else:
+            query = "SELECT * FROM builds ORDER BY started DESC LIMIT ?"
+            args = (limit,)
+        return self._conn.execute(query, args).fetchall()
+
+
+    def touch(self, path):
+        with self._conn:
+            self._conn.execute(
+                "INSERT OR REPLACE INTO usage VALUES (?, ?)",
+                (str(Path(path).absolute()), time.time())
+            )
+
+    def last_used(self, path):
+        row = self._conn.execute(
+            "SELECT last_used FROM usage WHERE path = ?", (str(Path(path).absolute()),)
+        ).fetchone()
+        return row["last_used"] if row else None
+
+    def rebuild_cost(self, output_dir):
+        """Duration of the last successful build which produced given directory."""
+        row = self._conn.execute(
+            """
+            SELECT duration FROM builds WHERE output_dir = ? AND status = 'success'
+            ORDER BY finished DESC LIMIT 1
+            """,
+            (str(Path(output_dir).absolute()),)
+        ).fetchone()
+        return row["duration"] if row else None
+
+    def acquire_lease(self, path):
+        """Protect the path from garbage collection while the current process is using it."""
+        self.touch(path)
+        with self._conn:
+            cur = self._conn.execute(
+                "INSERT INTO leases (path, pid, created) VALUES (?, ?, ?)",
+                (str(Path(path).absolute()), os.getpid(), time.time())
+            )
+        return cur.lastrowid
+
+    def release_lease(self, lease_id):
+        with self._conn:
+            self._conn.execute("DELETE FROM leases WHERE id = ?", (lease_id,))
+
+    @contextlib.contextmanager
+    def lease(self, path):
+        """Keep the path leased for the duration of the block."""
+        lease_id = self.acquire_lease(path)
+        try:
+            yield
+        finally:
+            self.release_lease(lease_id)
+
+    def leased_paths(self):
+        """Return paths leased by living processes and drop leases of dead ones."""
+        paths, stale = set(), []
+        for row in self._conn.execute("SELECT * FROM leases").fetchall():
+            try:
+                os.kill(row["pid"], 0)
+                paths.add(row["path"])
+            except ProcessLookupError:
+                stale.append((row["id"],))
+            except PermissionError:
+                paths.add(row["path"])
+        if stale:
+            with self._conn:
+                self._conn.executemany("DELETE FROM leases WHERE id = ?", stale)
+        return paths
+
+
+def _lock_path(workspace, name):
+    path = Path(workspace) / "locks" / f"{name}.lock"
+    os.makedirs(path.parent, exist_ok=True)
+    return path
+
+
+@contextlib.contextmanager
+def workspace_lock(workspace, name, shared=False, blocking=True):
+    """
+    Advisory lock of a workspace entry (e.g. `board-<name>`), held by processes
+    and threads using it. Writers take it exclusively, readers shared.
+    Without `blocking`, raises BlockingIOError if the lock is taken.
+    """
+    with open(_lock_path(workspace, name), "a") as f:
+        fcntl.flock(f, (fcntl.LOCK_SH if shared else fcntl.LOCK_EX) | (0 if blocking else fcntl.LOCK_NB))
+        try:
+            yield
+        finally:
+            fcntl.flock(f, fcntl.LOCK_UN)
+
+
+@contextlib.asynccontextmanager
+async def async_workspace_lock(workspace, name, shared=False, poll_interval=0.2):
+    """Same as `workspace_lock`, but waits without blocking the event loop."""
+    with open(_lock_path(workspace, name), "a") as f:
+        while True:
+            try:
+                fcntl.flock(f, (fcntl.LOCK_SH if shared else fcntl.LOCK_EX) | fcntl.LOCK_NB)
+                break
+            except BlockingIOError:
+                await asyncio.sleep(poll_interval)
+        try:
+            yield
+        finally:
+            fcntl.flock(f, fcntl.LOCK_UN)
+
+
+def staging_dir(workspace, name):
+    """
+    Unique directory for preparing files before they are published with `publish_dir`.
+    Its name contains the PID of the owner, so directories left by dead processes can be removed.
+    """
+    path = Path(workspace) / "staging"
+    os.makedirs(path, exist_ok=True)
+    path = Path(tempfile.mkdtemp(prefix=f"{name}-{os.getpid()}-", dir=path))
+    path.chmod(0o755)
+    return path
+
+
+AT_FDCWD = -100
+RENAME_EXCHANGE = 2
+
+
+def _exchange_paths(a, b):
+    """Atomically swap two paths with renameat2, returns False if it isn't supported."""
+    try:
+        renameat2 = ctypes.CDLL(None, use_errno=True).renameat2
+    except AttributeError:
+        return False
+    if renameat2(AT_FDCWD, os.fsencode(a), AT_FDCWD, os.fsencode(b), RENAME_EXCHANGE) == 0:
+        return True
+    err = ctypes.get_errno()
+    # Old kernels and some filesystems don't support exchanging
+    if err in (errno.ENOSYS, errno.EINVAL, errno.ENOTSUP):
+        return False
+    raise OSError(err, os.strerror(err), str(a), None, str(b))
+
+
+def publish_dir(src, dest):
+    """
+    Replace `dest` directory with `src`, so its readers see either the old or the
+    new version. Both directories are swapped in a single rename, the old one is
+    removed afterwards. Without support for it, `dest` is missing for a moment.
+    The caller must hold the exclusive lock of `dest`.
+    """
+    os.makedirs(dest.parent, exist_ok=True)
+    if dest.exists() and _exchange_paths(src, dest):
+        shutil.rmtree(src)
+        return dest
+
+    old = None
+    if dest.exists():
+        old = src.with_name(f"{src.name}.old")
+        os.rename(dest, old)
+    os.rename(src, dest)
+    if old:
+        shutil.rmtree(old)
+    return dest
+
+
+def zephyr_revision_dir(workspace, revision):
+    """West workspace of additional Zephyr revision created by setup.sh (ZEPHYR_REVISIONS)."""
+    return Path(workspace).absolute() / "zephyr-revisions" / revision
+
+
+def collect_build_inputs(board_name, app_path, workspace, extra_configs=None, zephyr_base=None):
+    """Return fingerprints of everything that determines the result of the build."""
+    zephyr_base = zephyr_base or os.environ.get("ZEPHYR_BASE")
+    board_dirs = list((workspace / "boards").glob(f"*/{board_name}"))
+
+    inputs = {
+        "board": fingerprint_dir(board_dirs[0]) if board_dirs else "",
+        "app": fingerprint_dir(app_path),
+        "zephyr": (git_revision(zephyr_base) if zephyr_base else None) or "",
+        "toolchain": toolchain_id() or "",
+    }
+    if extra_configs:
+        inputs["configs"] = ",".join(f"{k}={v}" for k, v in sorted(extra_configs.items()))
+    return inputs
+
+
+def build_history(board_name: str = None,
+                  soc: str = None,
+                  graph: Path = None,
+                  workspace: Path = Path("workspace"),
+                  limit: int = 20):
+    """
+    Show builds recorded in the workspace build database. Filters can be
+    combined; --graph selects builds of boards generated from the graph file.
+    """
+    graph_fingerprint = None
+    if graph:
+        from .parse_graph import Graph
+        from .specification import Specification
+        with open(graph) as f:
+            graph_json = json.load(f)
+        specification = Specification(workspace / "visual-system-designer-resources/components-specification.json")
+        graph_fingerprint = Graph(graph_json, specification).fingerprint
+
+    db = BuildDatabase(workspace)
+    builds = db.find_builds(board_name, soc, graph_fingerprint, limit)
+
+    if not builds:
+        print("No builds found.")
+
+    for b in builds:
+        started = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(b["started"]))
+        duration = f"{b['duration']:.1f}s" if b["duration"] is not None else "-"
+        print(f"#{b['id']:<5} {started}  {b['status']:<8} {duration:>8}  "
+              f"{b['board_name']} ({b['soc_name']}) {b['output_dir'] or ''}")
+    db.close()
@@ -0,0 +1,301 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Single-file bundle of build results, which can be moved to another host and
+simulated there without Zephyr installed.
+
+Layout (all integers big-endian):
+    MAGIC, 4-byte manifest length, manifest (JSON), files
+Every file starts at an offset aligned to ALIGN bytes, so it can be used
+directly from a memory-mapped bundle. Files are stored in the order of their
+offsets, so the bundle can also be read as a stream (e.g. from a pipe).
+
+The manifest describes the board and lists files with their offsets, sizes
+and SHA-256 hashes. The bundle is identified by the hash of its manifest
+without the creation time, so exports of the same build get the same id.
+"""
+
+import hashlib
+import json
+import logging
+import mmap
+import os
+import re
+import shutil
+import struct
+import sys
+import time
+
+from pathlib import Path
+
+from .build_db import BuildDatabase, file_digest, publish_dir, staging_dir, workspace_lock
+from .elf_image import load_image_path, symbols_path
+
+
+MAGIC = b"VSDBNDL\x01"
+ALIGN = 4096
+
+# Placeholder for the directory with the bundle contents in the resc template
+ROOT = "{root}"
+
+
+def _align(offset):
+    return (offset + ALIGN - 1) // ALIGN * ALIGN
+
+
+def _bundle_id(manifest):
+    content = {k: v for k, v in manifest.items() if k != "created"}
+    return hashlib.sha256(json.dumps(content, indent=1, sort_keys=True).encode()).hexdigest()
+
+
+def _check_board_name(name):
+    # Board names come from graph names with whitespace replaced, they are used as file names
+    if not isinstance(name, str) or not re.fullmatch(r"[^\s/\\]+", name) or name in (".", ".."):
+        raise ValueError(f"Invalid board name '{name}'")
+    return name
+
+
+def _bundle_files(board_name, builds_dir, checkpoints):
+    elf_path = builds_dir / "zephyr/zephyr.elf"
+    paths = [
+        elf_path,
+        builds_dir / "zephyr/zephyr.dts",
+        builds_dir / "zephyr/.config",
+        builds_dir / f"{board_name}.repl",
+        load_image_path(elf_path),
+        symbols_path(elf_path),
+    ]
+    if checkpoints:
+        paths += sorted((builds_dir / "checkpoints").glob("*.save"))
+    return [(str(p.relative_to(builds_dir)), p) for p in paths if p.exists()]
+
+
+def _resc_template(board_name, builds_dir, templates_dir):
+    from .simulate import _find_chosen
+
+    with open(templates_dir / "run.resc") as f:
+        template = f.read()
+    return template.format(
+        board_name=board_name,
+        resc_path=f"{ROOT}/{board_name}.resc",
+        repl_path=f"{ROOT}/{board_name}.repl",
+        elf_path=f"{ROOT}/zephyr/zephyr.elf",
+        console=_find_chosen("zephyr,console", builds_dir / "zephyr/zephyr.dts"),
+    )
+
+
+def write_bundle(board_name, workspace, output, templates_dir, checkpoints=False):
+    """
+    Pack build results of the board into a bundle. Returns the bundle id.
+    `output` is a path or '-' for the standard output.
+    """
+    builds_dir = workspace / "builds" / board_name
+    files = _bundle_files(board_name, builds_dir, checkpoints)
+    if not any(name == "zephyr/zephyr.elf" for name, _ in files):
+        raise FileNotFoundError(f"Board {board_name} isn't built")
+    if not any(name == f"{board_name}.repl" for name, _ in files):
+        raise FileNotFoundError(f"Renode files for board {board_name} aren't prepared")
+
+    resc = _resc_template(board_name, builds_dir, templates_dir).encode()
+
+    db = BuildDatabase(workspace)
+    board = db.get_board(board_name)
+    builds = db.history(board_name, limit=1)
+    db.close()
+
+    manifest = {
+        "version": 1,
+        "board_name": board_name,
+        "soc_name": board["soc_name"] if board else None,
+        "graph_fingerprint": board["graph_fingerprint"] if board else None,
+        "zephyr_revision": builds[0]["zephyr_revision"] if builds else None,
+        "app_revision": builds[0]["app_revision"] if builds else None,
+        "created": time.time(),
+        "resc_template": "run.resc.in",
+        "files": [],
+    }
+    entries = [(name, path.stat().st_size, file_digest(path), path) for name, path in files]
+    entries.append(("run.resc.in", len(resc), hashlib.sha256(resc).hexdigest(), resc))
+
+    # Offsets depend on the manifest size, which depends on the offsets
+    header_size = ALIGN
+    while True:
+        offset = header_size
+        manifest["files"] = []
+        for name, size, digest, _ in entries:
+            manifest["files"].append({"name": name, "offset": offset, "size": size, "sha256": digest})
+            offset = _align(offset + size)
+        data = json.dumps(manifest, indent=1, sort_keys=True).encode()
+        if len(MAGIC) + 4 + len(data) <= header_size:
+            break
+        header_size = _align(len(MAGIC) + 4 + len(data))
+
+    def write(f):
+        f.write(MAGIC + struct.pack(">I", len(data)) + data)
+        position = len(MAGIC) + 4 + len(data)
+        for entry, (_, size, _, source) in zip(manifest["files"], entries):
+            f.write(b"\0" * (entry["offset"] - position))
+            if isinstance(source, bytes):
+                f.write(source)
+            else:
+                with open(source, "rb") as src:
+                    shutil.copyfileobj(src, f)
+            position = entry["offset"] + size
+
+    if str(output) == "-":
+        write(sys.stdout.buffer)
+        sys.stdout.buffer.flush()
+    elif output.exists() and not output.is_file():
+        # Devices and pipes (e.g. /dev/stdout) can't be replaced by renaming
+        with open(output, "wb") as f:
+            write(f)
+    else:
+        tmp = output.with_name(f".{output.name}.tmp")
+        with open(tmp, "wb") as f:
+            write(f)
+        os.rename(tmp, output)
+    return _bundle_id(manifest)
+
+
+def _read_exact(stream, size):
+    data = bytearray()
+    while len(data) < size:
+        chunk = stream.read(min(size - len(data), 1 << 20))
+        if not chunk:
+            raise ValueError("Bundle is truncated")
+        data.extend(chunk)
+    return bytes(data)
+
+
+def _read_manifest(stream):
+    if _read_exact(stream, len(MAGIC)) != MAGIC:
+        raise ValueError("Not a VSD bundle")
+    (size,) = struct.unpack(">I", _read_exact(stream, 4))
+    manifest = json.loads(_read_exact(stream, size))
+    return manifest, _bundle_id(manifest), len(MAGIC) + 4 + size
+
+
+class Bundle():
+    """Memory-mapped bundle giving access to the files without extracting them."""
+    def __init__(self, path):
+        self._file = open(path, "rb")
+        self.manifest, self.id, _ = _read_manifest(self._file)
+        self._map = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.files = {entry["name"]: entry for entry in self.manifest["files"]}
+
+    def read(self, name):
+        entry = self.files[name]
+        return memoryview(self._map)[entry["offset"]:entry["offset"] + entry["size"]]
+
+    def extract(self, dest):
+        for entry in self.manifest["files"]:
+            data = self.read(entry["name"])
+            _write_entry(dest, entry, (data[i:i + (1 << 20)] for i in range(0, len(data), 1 << 20)))
+
+    def close(self):
+        self._map.close()
+        self._file.close()
+
+
+def _write_entry(dest, entry, chunks):
+    path = dest / entry["name"]
+    if not path.resolve().is_relative_to(dest.resolve()):
+        raise ValueError(f"Bundle entry {entry['name']} is outside of the destination")
+    os.makedirs(path.parent, exist_ok=True)
+
+    digest = hashlib.sha256()
+    with open(path, "wb") as f:
+        for chunk in chunks:
+            digest.update(chunk)
+            f.write(chunk)
+    if digest.hexdigest() != entry["sha256"]:
+        raise ValueError(f"Bundle entry {entry['name']} is corrupted")
+
+
+def extract_stream(stream, dest):
+    """Extract the bundle read sequentially from the stream, verifying the file hashes."""
+    manifest, bundle_id, position = _read_manifest(stream)
+    for entry in sorted(manifest["files"], key=lambda e: e["offset"]):
+        _read_exact(stream, entry["offset"] - position)
+        sizes = [min(1 << 20, entry["size"] - i) for i in range(0, entry["size"], 1 << 20)]
+        _write_entry(dest, entry, (_read_exact(stream, size) for size in sizes))
+        position = entry["offset"] + entry["size"]
+    return manifest, bundle_id
+
+
+def export_bundle(board_name: str,
+                  workspace: Path = Path("workspace"),
+                  output: Path = None,
+                  templates_dir: Path = Path("renode-templates"),
+                  checkpoints: bool = False):
+    """
+    Pack build results of the board into a single file, which can be simulated
+    on another host after import-bundle. With --checkpoints, emulation
+    snapshots of the board are included too. With '--output -', the bundle is
+    written to the standard output.
+    """
+    bundles_dir = workspace / "bundles"
+    os.makedirs(bundles_dir, exist_ok=True)
+    tmp = output or bundles_dir / f"{board_name}.vsdbundle"
+    try:
+        # Results of a build running at the moment would be mixed with the old ones
+        with workspace_lock(workspace, f"build-{board_name}"):
+            bundle_id = write_bundle(board_name, workspace, tmp, templates_dir, checkpoints)
+    except FileNotFoundError as e:
+        logging.error(e)
+        sys.exit(1)
+
+    if not output:
+        # Default name includes the content hash, so bundles of different builds don't collide
+        output = bundles_dir / f"{board_name}-{bundle_id[:12]}.vsdbundle"
+        os.rename(tmp, output)
+    # Standard output can carry the bundle itself
+    print(f"Bundle {bundle_id} saved in {output}", file=sys.stderr if str(output) == "-" else sys.stdout)
+
+
+def import_bundle(bundle: Path,
+                  workspace: Path = Path("workspace"),
+                  board_name: str = None):
+    """
+    Unpack the bundle (or standard input with '-') to the workspace, so its
+    board can be simulated. Zephyr isn't needed for that.
+    """
+    staging = staging_dir(workspace, "bundle")
+    root = staging / "bundle"
+    os.makedirs(root)
+    try:
+        if str(bundle) == "-":
+            manifest, bundle_id = extract_stream(sys.stdin.buffer, root)
+        else:
+            reader = Bundle(bundle)
+            try:
+                reader.extract(root)
+                manifest, bundle_id = reader.manifest, reader.id
+            finally:
+                reader.close()
+
+        # Names from the manifest are used in paths, only verified entries can be read
+        original_name = _check_board_name(manifest.get("board_name"))
+        board_name = _check_board_name(board_name or original_name)
+        if manifest.get("resc_template") not in {entry["name"] for entry in manifest["files"]}:
+            raise ValueError("Renode script template isn't one of the bundle files")
+    except (OSError, ValueError, KeyError, TypeError) as e:
+        shutil.rmtree(staging)
+        logging.error(f"Can't import {bundle}: {e}")
+        sys.exit(1)
+
+    if board_name != original_name:
+        os.rename(root / f"{original_name}.repl", root / f"{board_name}.repl")
+
+    builds_dir = workspace / "builds" / board_name
+    template = (root / manifest["resc_template"]).read_text()
+    (root / manifest["resc_template"]).unlink()
+    resc = template.replace(f"{ROOT}/{original_name}.", f"{ROOT}/{board_name}.")
+    (root / f"{board_name}.resc").write_text(resc.replace(ROOT, str(builds_dir.absolute())))
+    (root / "bundle.json").write_text(json.dumps(dict(manifest, id=bundle_id), indent=4))
+
+    with workspace_lock(workspace, f"build-{board_name}"):
+        publish_dir(root, builds_dir)
+    shutil.rmtree(staging)
+    print(f"Bundle {bundle_id[:12]} of {original_name} imported as {board_name} in {builds_dir}")
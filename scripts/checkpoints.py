@@ -0,0 +1,59 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+import os
+import shutil
+
+from pathlib import Path
+
+
+class CheckpointStore():
+    """
+    Directory with emulation snapshots taken at given points of virtual time.
+
+    When the size of the store exceeds its limit, checkpoints lying closest to
+    their neighbours are removed first, so the remaining ones are still spread
+    over the whole run. The first and the last checkpoint are always kept.
+    """
+    def __init__(self, path, interval, max_bytes):
+        self.path = Path(path)
+        self.interval = interval
+        self.max_bytes = max_bytes
+        os.makedirs(self.path, exist_ok=True)
+
+    def clear(self):
+        shutil.rmtree(self.path, ignore_errors=True)
+        os.makedirs(self.path, exist_ok=True)
+
+    def checkpoint_path(self, virtual_time):
+        return self.path / f"{round(virtual_time * 1000):012}.save"
+
+    def checkpoints(self):
+        """Return (virtual_time, path) pairs sorted by time."""
+        return sorted(
+            (int(p.stem) / 1000, p) for p in self.path.glob("*.save") if p.stem.isdigit()
+        )
+
+    def nearest(self, virtual_time):
+        """Return the latest checkpoint taken not later than given time."""
+        found = None
+        for t, path in self.checkpoints():
+            if t > virtual_time:
+                break
+            found = (t, path)
+        return found
+
+    def size(self):
+        return sum(p.stat().st_size for _, p in self.checkpoints())
+
+    def trim(self):
+        checkpoints = self.checkpoints()
+        total = sum(p.stat().st_size for _, p in checkpoints)
+        while total > self.max_bytes and len(checkpoints) > 2:
+            gaps = [checkpoints[i + 1][0] - checkpoints[i - 1][0] for i in range(1, len(checkpoints) - 1)]
+            i = gaps.index(min(gaps)) + 1
+            _, path = checkpoints.pop(i)
+            total -= path.stat().st_size
+            path.unlink()
+            logging.debug(f"Removed checkpoint {path.name}")
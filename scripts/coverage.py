@@ -0,0 +1,196 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import fcntl
+import logging
+import os
+
+from collections import defaultdict
+from pathlib import Path
+
+from .build_db import file_digest
+from .elf_image import ElfFile, PT_LOAD
+
+
+PF_X = 1
+
+# Smallest instruction size on supported architectures (Thumb, RVC)
+GRANULE = 2
+
+
+class CoverageBitmap():
+    """One bit for every possible instruction address in executable segments of the firmware."""
+    def __init__(self, elf_path):
+        elf = ElfFile(elf_path)
+        segments = [s for s in elf.segments if s["type"] == PT_LOAD and s["flags"] & PF_X]
+        if not segments:
+            raise ValueError(f"{elf_path} has no executable segments")
+
+        self.base = min(s["vaddr"] for s in segments)
+        self.end = max(s["vaddr"] + s["memsz"] for s in segments)
+        self.bits = bytearray(((self.end - self.base) // GRANULE + 7) // 8)
+
+    def mark(self, addresses):
+        for addr in addresses:
+            if self.base <= addr < self.end:
+                i = (addr - self.base) // GRANULE
+                self.bits[i >> 3] |= 1 << (i & 7)
+
+    def is_covered(self, start, end):
+        """Check if any address in [start, end) was executed."""
+        for addr in range(max(start, self.base), min(end, self.end), GRANULE):
+            i = (addr - self.base) // GRANULE
+            if self.bits[i >> 3] & (1 << (i & 7)):
+                return True
+        return False
+
+    def merge(self, data):
+        merged = int.from_bytes(self.bits, "little") | int.from_bytes(data, "little")
+        self.bits = bytearray(merged.to_bytes(len(self.bits), "little"))
+
+    def count(self):
+        return sum(bin(b).count("1") for b in self.bits)
+
+
+def read_trace(trace_path, chunk_lines=1 << 16):
+    """Yield sets of unique addresses from execution trace written in the PC format."""
+    addresses = set()
+    with open(trace_path) as f:
+        for i, line in enumerate(f):
+            try:
+                addresses.add(int(line, 16))
+            except ValueError:
+                continue
+            if i % chunk_lines == 0 and addresses:
+                yield addresses
+                addresses = set()
+    if addresses:
+        yield addresses
+
+
+class CoverageStore():
+    """
+    Coverage bitmaps stored per firmware (identified by ELF hash). Results of
+    runs are OR-ed into the stored bitmap under a file lock, so many parallel
+    runs can add their results safely.
+    """
+    def __init__(self, workspace):
+        self.path = Path(workspace) / "coverage"
+        os.makedirs(self.path, exist_ok=True)
+
+    def bitmap_path(self, elf_path):
+        return self.path / f"{file_digest(elf_path)}.bin"
+
+    def add(self, elf_path, bitmap):
+        path = self.bitmap_path(elf_path)
+        with open(path, "a+b") as f:
+            fcntl.flock(f, fcntl.LOCK_EX)
+            f.seek(0)
+            stored = f.read()
+            if len(stored) == len(bitmap.bits):
+                bitmap.merge(stored)
+            f.seek(0)
+            f.truncate()
+            f.write(bitmap.bits)
+
+    def load(self, elf_path):
+        bitmap = CoverageBitmap(elf_path)
+        path = self.bitmap_path(elf_path)
+        if path.exists():
+            bitmap.merge(path.read_bytes())
+        return bitmap
+
+
+def fold_trace(bitmap, trace_path):
+    """Mark addresses from the execution trace in the bitmap and remove the trace."""
+    if not trace_path.exists():
+        logging.warning(f"Execution trace {trace_path} not found")
+        return
+    for addresses in read_trace(trace_path):
+        bitmap.mark(addresses)
+    trace_path.unlink()
+
+
+def _str(value):
+    return value.decode() if isinstance(value, bytes) else value
+
+
+def line_ranges(elf_path):
+    """Map source lines to address ranges using DWARF line tables."""
+    from elftools.elf.elffile import ELFFile
+
+    ranges = defaultdict(list)
+    with open(elf_path, "rb") as f:
+        elf = ELFFile(f)
+        if not elf.has_dwarf_info():
+            raise ValueError(f"{elf_path} has no debug information")
+
+        dwarf = elf.get_dwarf_info()
+        for cu in dwarf.iter_CUs():
+            lineprog = dwarf.line_program_for_CU(cu)
+            if lineprog is None:
+                continue
+
+            comp_dir = cu.get_top_DIE().attributes.get("DW_AT_comp_dir")
+            comp_dir = _str(comp_dir.value) if comp_dir else ""
+            file_entries = lineprog["file_entry"]
+            include_dirs = [_str(d) for d in lineprog["include_directory"]]
+            dwarf5 = lineprog.header.version >= 5
+
+            def file_name(index):
+                # DWARF 5 numbers files and directories from 0 (directory 0 is the
+                # compilation directory), earlier versions from 1
+                if dwarf5:
+                    entry = file_entries[index]
+                    directory = include_dirs[entry.dir_index]
+                else:
+                    entry = file_entries[index - 1]
+                    directory = include_dirs[entry.dir_index - 1] if entry.dir_index > 0 else ""
+                name = os.path.join(directory, _str(entry.name))
+                return os.path.normpath(os.path.join(comp_dir, name))
+
+            prev = None
+            for entry in lineprog.get_entries():
+                state = entry.state
+                if state is None:
+                    continue
+                if prev is not None and state.address > prev.address:
+                    ranges[(file_name(prev.file), prev.line)].append((prev.address, state.address))
+                prev = None if state.end_sequence else state
+
+    return ranges
+
+
+def write_lcov(elf_path, bitmap, output, source_filter=None):
+    files = defaultdict(dict)
+    for (source, line), addr_ranges in line_ranges(elf_path).items():
+        if line == 0 or (source_filter and source_filter not in source):
+            continue
+        hit = any(bitmap.is_covered(start, end) for start, end in addr_ranges)
+        files[source][line] = max(files[source].get(line, 0), int(hit))
+
+    with open(output, "w") as f:
+        for source in sorted(files):
+            lines = files[source]
+            f.write(f"TN:\nSF:{source}\n")
+            for line in sorted(lines):
+                f.write(f"DA:{line},{lines[line]}\n")
+            f.write(f"LF:{len(lines)}\nLH:{sum(1 for v in lines.values() if v)}\nend_of_record\n")
+
+    return files
+
+
+def coverage_report(board_name: str,
+                    workspace: Path = Path("workspace"),
+                    output: Path = None,
+                    source_filter: str = None):
+    """Write lcov report of firmware code executed in simulations with --coverage."""
+    elf_path = workspace / 'builds' / board_name / "zephyr/zephyr.elf"
+    output = output or workspace / 'builds' / board_name / "coverage.info"
+
+    bitmap = CoverageStore(workspace).load(elf_path)
+    files = write_lcov(elf_path, bitmap, output, source_filter)
+
+    total = sum(len(lines) for lines in files.values())
+    hit = sum(1 for lines in files.values() for v in lines.values() if v)
+    print(f"Lines covered: {hit}/{total} in {len(files)} files. Report saved in {output}")
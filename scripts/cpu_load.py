@@ -0,0 +1,154 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import re
+import statistics
+import threading
+import time
+
+from collections import defaultdict
+
+
+# Kconfig options passed to the build with --thread-stats. The thread analyzer
+# prints runtime statistics of all threads to the console periodically.
+THREAD_STATS_CONFIGS = {
+    "CONFIG_THREAD_NAME": "y",
+    "CONFIG_THREAD_RUNTIME_STATS": "y",
+    "CONFIG_THREAD_ANALYZER": "y",
+    "CONFIG_THREAD_ANALYZER_USE_PRINTK": "y",
+    "CONFIG_THREAD_ANALYZER_AUTO": "y",
+    "CONFIG_THREAD_ANALYZER_AUTO_INTERVAL": "5",
+}
+
+_THREAD_LINE = re.compile(
+    r"^(?:\[(?P<tag>[^\]]+)\] )?\s*(?P<name>\S.*?)\s*: STACK: unused \d+ usage (?P<used>\d+) / (?P<size>\d+) \(\d+ %\); CPU: (?P<cpu>\d+) %"
+)
+
+
+class CPULoad():
+    """
+    Measures how busy the CPUs were during a period of virtual time.
+
+    Renode executes instructions at the rate given by the CPU performance (MIPS)
+    and lets the virtual time pass without executing anything while the CPU is
+    halted (e.g. in WFI), so the ratio of executed instructions to the number of
+    instructions that fit in the elapsed time is the utilization of the CPU.
+    """
+    def __init__(self, emu, machines):
+        from Antmicro.Renode.Peripherals.CPU import ICPU
+        from pyrenode3 import wrappers
+
+        self.emu = emu
+        self.cpus = []
+        for machine_name, machine in machines:
+            for cpu in machine.GetPeripheralsOfType[ICPU]():
+                self.cpus.append((f"{machine_name}.{wrappers.Peripheral(cpu).name}", cpu))
+        self.reset()
+
+    def _virtual_time(self):
+        return self.emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds
+
+    def reset(self):
+        self._start_time = self._virtual_time()
+        self._start_instructions = {name: int(cpu.ExecutedInstructions) for name, cpu in self.cpus}
+
+    def report(self):
+        """Return list of (cpu name, busy ratio, executed instructions) tuples."""
+        elapsed = self._virtual_time() - self._start_time
+        result = []
+        for name, cpu in self.cpus:
+            executed = int(cpu.ExecutedInstructions) - self._start_instructions[name]
+            capacity = elapsed * int(cpu.PerformanceInMips) * 1e6
+            busy = min(executed / capacity, 1.0) if capacity > 0 else 0.0
+            result.append((name, busy, executed))
+        return elapsed, result
+
+
+class RealTimeFactor():
+    """
+    Samples the ratio of virtual time to host time in short periods of host
+    time, to show how stable the simulation speed is, e.g. while the host builds.
+    """
+    def __init__(self, emu, interval=0.5):
+        self.emu = emu
+        self.interval = interval
+        self.samples = []
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._sample, daemon=True)
+
+    def _virtual_time(self):
+        return self.emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds
+
+    def start(self):
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+        self._thread.join()
+
+    def _sample(self):
+        last_virtual, last_host = self._virtual_time(), time.perf_counter()
+        while not self._stop.wait(self.interval):
+            virtual, host = self._virtual_time(), time.perf_counter()
+            self.samples.append((virtual - last_virtual) / (host - last_host))
+            last_virtual, last_host = virtual, host
+
+    def report(self):
+        """Return (mean, standard deviation, min, max) of the sampled real-time factor."""
+        if len(self.samples) < 2:
+            return None
+        return (statistics.mean(self.samples), statistics.stdev(self.samples),
+                min(self.samples), max(self.samples))
+
+
+class ThreadStats():
+    """Collects thread statistics printed by the Zephyr thread analyzer on the console."""
+    def __init__(self):
+        self._partial = ""
+        self.cpu = defaultdict(list)
+        self.stack = {}
+
+    def feed(self, text):
+        lines = (self._partial + text).split("\n")
+        self._partial = lines.pop()
+        for line in lines:
+            m = _THREAD_LINE.match(line)
+            if m:
+                # Lines of fleet machines are tagged with the machine name
+                name = "/".join(filter(None, [m.group("tag"), m.group("name")]))
+                self.cpu[name].append(int(m.group("cpu")))
+                self.stack[name] = (int(m.group("used")), int(m.group("size")))
+
+    def report(self):
+        """Return list of (thread name, average CPU %, samples, stack used, stack size) tuples."""
+        return [
+            (name, sum(samples) / len(samples), len(samples), *self.stack[name])
+            for name, samples in sorted(self.cpu.items(), key=lambda t: -sum(t[1]) / len(t[1]))
+        ]
+
+
+def print_rtf_report(rtf):
+    report = rtf.report()
+    if report is None:
+        print("\nThe simulation was too short to measure the real-time factor")
+        return
+    mean, stdev, low, high = report
+    print(f"\nReal-time factor over {len(rtf.samples)} periods of {rtf.interval}s: mean {mean:.3f}, "
+          f"stdev {stdev:.3f} ({stdev / mean * 100 if mean else 0:.1f} %), min {low:.3f}, max {high:.3f}")
+
+
+def print_load_report(cpu_load, thread_stats=None):
+    elapsed, cpus = cpu_load.report()
+    print(f"\nCPU load over {elapsed:.3f}s of virtual time:")
+    for name, busy, executed in cpus:
+        print(f"  {name:<24} busy {busy * 100:6.2f} %  idle {(1 - busy) * 100:6.2f} %  ({executed} instructions)")
+
+    if thread_stats is None:
+        return
+    threads = thread_stats.report()
+    if not threads:
+        print("No thread statistics found in the console output (is the firmware built with --thread-stats?)")
+        return
+    print("Thread load (average of thread analyzer samples):")
+    for name, cpu, samples, used, size in threads:
+        print(f"  {name:<24} CPU {cpu:6.2f} %  stack {used}/{size} B  ({samples} samples)")
@@ -0,0 +1,167 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import struct
+
+from pathlib import Path
+
+
+PT_LOAD = 1
+SHT_NULL = 0
+SHT_SYMTAB = 2
+SHT_STRTAB = 3
+SHT_NOBITS = 8
+
+
+class ElfFile():
+    """Minimal ELF reader providing headers needed to rewrite the file."""
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError(f"{path} is not an ELF file")
+
+        self.is64 = self.data[4] == 2
+        self.endian = "<" if self.data[5] == 1 else ">"
+
+        if self.is64:
+            self._ehdr_fmt = self.endian + "16sHHIQQQIHHHHHH"
+            self._phdr_fmt = self.endian + "IIQQQQQQ"
+            self._shdr_fmt = self.endian + "IIQQQQIIQQ"
+        else:
+            self._ehdr_fmt = self.endian + "16sHHIIIIIHHHHHH"
+            self._phdr_fmt = self.endian + "IIIIIIII"
+            self._shdr_fmt = self.endian + "IIIIIIIIII"
+
+        (self.ident, self.type, self.machine, self.version, self.entry, self.phoff,
+         self.shoff, self.flags, self.ehsize, self.phentsize, self.phnum,
+         self.shentsize, self.shnum, self.shstrndx) = struct.unpack_from(self._ehdr_fmt, self.data)
+
+        self.segments = [self._read_phdr(i) for i in range(self.phnum)]
+        self.sections = [self._read_shdr(i) for i in range(self.shnum)]
+
+    def _read_phdr(self, i):
+        fields = struct.unpack_from(self._phdr_fmt, self.data, self.phoff + i * self.phentsize)
+        if self.is64:
+            names = ["type", "flags", "offset", "vaddr", "paddr", "filesz", "memsz", "align"]
+        else:
+            names = ["type", "offset", "vaddr", "paddr", "filesz", "memsz", "flags", "align"]
+        return dict(zip(names, fields))
+
+    def _read_shdr(self, i):
+        fields = struct.unpack_from(self._shdr_fmt, self.data, self.shoff + i * self.shentsize)
+        names = ["name", "type", "flags", "addr", "offset", "size", "link", "info", "addralign", "entsize"]
+        return dict(zip(names, fields))
+
+    def pack_ehdr(self, phoff, phnum, shoff, shnum, shstrndx):
+        return struct.pack(
+            self._ehdr_fmt, self.ident, self.type, self.machine, self.version, self.entry,
+            phoff, shoff, self.flags, struct.calcsize(self._ehdr_fmt),
+            struct.calcsize(self._phdr_fmt) if phnum else 0, phnum,
+            struct.calcsize(self._shdr_fmt) if shnum else 0, shnum, shstrndx
+        )
+
+    def pack_phdr(self, phdr):
+        if self.is64:
+            order = ["type", "flags", "offset", "vaddr", "paddr", "filesz", "memsz", "align"]
+        else:
+            order = ["type", "offset", "vaddr", "paddr", "filesz", "memsz", "flags", "align"]
+        return struct.pack(self._phdr_fmt, *(phdr[k] for k in order))
+
+    def pack_shdr(self, shdr):
+        order = ["name", "type", "flags", "addr", "offset", "size", "link", "info", "addralign", "entsize"]
+        return struct.pack(self._shdr_fmt, *(shdr[k] for k in order))
+
+
+def _align(offset, phdr):
+    """Keep file offset congruent with the virtual address, as required by ELF loaders."""
+    align = min(phdr["align"], 0x1000) or 1
+    return offset + (phdr["vaddr"] - offset) % align
+
+
+def write_load_image(elf_path, dest_path):
+    """
+    Write ELF containing only loadable segments, without sections, symbols
+    and debug information, so it can be loaded by the simulator quickly.
+    """
+    elf = ElfFile(elf_path)
+    segments = [dict(s) for s in elf.segments if s["type"] == PT_LOAD and s["memsz"] > 0]
+
+    ehdr_size = struct.calcsize(elf._ehdr_fmt)
+    phdr_size = struct.calcsize(elf._phdr_fmt)
+
+    offset = ehdr_size + phdr_size * len(segments)
+    chunks = []
+    for seg in segments:
+        data = elf.data[seg["offset"]:seg["offset"] + seg["filesz"]]
+        seg["offset"] = _align(offset, seg) if seg["filesz"] else 0
+        if seg["filesz"]:
+            chunks.append((seg["offset"], data))
+            offset = seg["offset"] + len(data)
+
+    out = bytearray(offset)
+    out[:ehdr_size] = elf.pack_ehdr(ehdr_size, len(segments), 0, 0, 0)
+    for i, seg in enumerate(segments):
+        start = ehdr_size + i * phdr_size
+        out[start:start + phdr_size] = elf.pack_phdr(seg)
+    for start, data in chunks:
+        out[start:start + len(data)] = data
+
+    with open(dest_path, "wb") as f:
+        f.write(out)
+
+
+def write_symbols_file(elf_path, dest_path):
+    """
+    Write ELF that keeps only symbol and string tables of the original file.
+    Headers of other sections are preserved as NOBITS, so symbol section
+    indices stay valid (similar to `objcopy --only-keep-debug`).
+    """
+    elf = ElfFile(elf_path)
+
+    ehdr_size = struct.calcsize(elf._ehdr_fmt)
+    shdr_size = struct.calcsize(elf._shdr_fmt)
+
+    offset = ehdr_size
+    chunks = []
+    sections = []
+    for i, sec in enumerate(elf.sections):
+        sec = dict(sec)
+        if sec["type"] in (SHT_SYMTAB, SHT_STRTAB):
+            align = sec["addralign"] or 1
+            offset += -offset % align
+            chunks.append((offset, elf.data[sec["offset"]:sec["offset"] + sec["size"]]))
+            sec["offset"] = offset
+            offset += sec["size"]
+        elif sec["type"] != SHT_NULL:
+            sec["type"] = SHT_NOBITS
+            sec["offset"] = 0
+        sections.append(sec)
+
+    offset += -offset % 8
+    shoff = offset
+
+    out = bytearray(shoff + shdr_size * len(sections))
+    out[:ehdr_size] = elf.pack_ehdr(0, 0, shoff, len(sections), elf.shstrndx)
+    for start, data in chunks:
+        out[start:start + len(data)] = data
+    for i, sec in enumerate(sections):
+        start = shoff + i * shdr_size
+        out[start:start + shdr_size] = elf.pack_shdr(sec)
+
+    with open(dest_path, "wb") as f:
+        f.write(out)
+
+
+def load_image_path(elf_path):
+    return Path(elf_path).with_suffix(".load.elf")
+
+
+def symbols_path(elf_path):
+    return Path(elf_path).with_suffix(".symbols.elf")
+
+
+def prepare_fast_load_files(elf_path):
+    write_load_image(elf_path, load_image_path(elf_path))
+    write_symbols_file(elf_path, symbols_path(elf_path))
@@ -0,0 +1,464 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Build executors running Zephyr builds outside of the local workspace.
+
+The executor and the client talk over a pair of pipes (stdin/stdout of the worker
+process, locally or through SSH). Every message is a JSON header preceded by its
+length (4 bytes, big endian); a header with the "size" field is followed by that
+many bytes of payload (a tar archive).
+
+Client -> worker:
+    {"op": "load"}
+    {"op": "has", "hashes"}                        (which objects are missing in the store)
+    {"op": "put", "hash", "size"} + file contents
+    {"op": "build", "board_name", "board_dir", "extra_configs", "zephyr_revision", "size"} + tar with
+        "board/" (board directory) and "app/" (application sources)
+    {"op": "simulate", "board_name", "files", "args"}
+
+Worker -> client:
+    {"op": "load", "load", "cpus"}
+    {"op": "has", "missing"}
+    {"op": "put"}
+    {"op": "log", "data"}                          (build output, many messages)
+    {"op": "result", "returncode", "size"} + tar with build artifacts
+    {"op": "result", "returncode", "wall_time", "size"} + console output of the simulation
+
+Files needed by simulations are kept in the object store of the worker, named by
+their SHA-256, so they are transferred to every host only once.
+
+Closing the pipes aborts the build or simulation running in the worker.
+"""
+
+import asyncio
+import hashlib
+import io
+import json
+import logging
+import os
+import shlex
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tarfile
+import tempfile
+import threading
+import time
+
+from pathlib import Path
+from urllib.parse import urlparse, parse_qs
+
+from .build_db import file_digest
+
+
+_HEADER = struct.Struct(">I")
+
+# How long the load reported by an executor is considered valid
+LOAD_TTL = 10.0
+
+
+def _pack_dir(tar, path, arcname):
+    for root, dirs, files in os.walk(path):
+        dirs[:] = [d for d in dirs if not d.startswith(".") and d != "build"]
+        for name in files:
+            file = Path(root) / name
+            tar.add(file, arcname=f"{arcname}/{file.relative_to(path)}")
+
+
+def _extract(data, dest):
+    with tarfile.open(fileobj=io.BytesIO(data)) as tar:
+        for member in tar.getmembers():
+            target = (Path(dest) / member.name).resolve()
+            if not (member.isfile() or member.isdir()) or Path(dest).resolve() not in target.parents:
+                raise ValueError(f"Unexpected entry in the archive: {member.name}")
+        tar.extractall(dest)
+
+
+def pack_build_sources(board_dir, app_path):
+    buf = io.BytesIO()
+    with tarfile.open(fileobj=buf, mode="w:gz") as tar:
+        _pack_dir(tar, board_dir, "board")
+        _pack_dir(tar, app_path, "app")
+    return buf.getvalue()
+
+
+# Worker side. It is run as `python3 -m scripts.executors` in the root of VSD repository.
+
+def _write_message(out, header, payload=b""):
+    data = json.dumps(header).encode()
+    out.write(_HEADER.pack(len(data)) + data + payload)
+    out.flush()
+
+
+def _read_exactly(inp, size):
+    data = bytearray()
+    while len(data) < size:
+        chunk = inp.read(size - len(data))
+        if not chunk:
+            raise EOFError
+        data.extend(chunk)
+    return bytes(data)
+
+
+def _read_message(inp):
+    header = json.loads(_read_exactly(inp, _HEADER.unpack(_read_exactly(inp, _HEADER.size))[0]))
+    payload = _read_exactly(inp, header["size"]) if "size" in header else b""
+    return header, payload
+
+
+def _abort_on_eof(inp, proc):
+    def wait_for_eof():
+        # The client closes the pipe to abort the job. Raw reads are used,
+        # so the thread doesn't hold the lock of the buffered stream.
+        while os.read(inp.fileno(), 4096):
+            pass
+        if proc.poll() is None:
+            os.killpg(proc.pid, signal.SIGTERM)
+
+    threading.Thread(target=wait_for_eof, daemon=True).start()
+
+
+def object_store():
+    path = Path(os.environ.get("XDG_CACHE_HOME", Path.home() / ".cache")) / "vsd-executor" / "objects"
+    os.makedirs(path, exist_ok=True)
+    return path
+
+
+def _put_object(header, payload):
+    if hashlib.sha256(payload).hexdigest() != header["hash"]:
+        raise ValueError(f"Object {header['hash']} is corrupted")
+    path = object_store() / header["hash"]
+    tmp = path.with_suffix(f".{os.getpid()}.tmp")
+    tmp.write_bytes(payload)
+    os.replace(tmp, path)
+
+
+def _run_simulation(header, inp, out):
+    store = object_store()
+    vsd_path = Path(__file__).parent.parent / "vsd.py"
+
+    with tempfile.TemporaryDirectory(prefix="vsd-executor-") as tmp:
+        workdir = Path(tmp) / "workspace"
+        for rel_path, digest in header["files"].items():
+            dest = workdir / rel_path
+            os.makedirs(dest.parent, exist_ok=True)
+            shutil.copy(store / digest, dest)
+
+        log_path = Path(tmp) / "console.log"
+        command = [sys.executable, str(vsd_path), "simulate", header["board_name"],
+                   "--workdir", str(workdir), "--log-file", str(log_path)]
+        command += [str(a).replace("{workdir}", str(workdir)) for a in header.get("args", [])]
+
+        start = time.perf_counter()
+        proc = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.STDOUT,
+                                start_new_session=True)
+        _abort_on_eof(inp, proc)
+        proc.wait()
+        wall_time = time.perf_counter() - start
+
+        data = log_path.read_bytes() if log_path.exists() else b""
+        _write_message(out, {"op": "result", "returncode": proc.returncode, "wall_time": wall_time,
+                             "size": len(data)}, data)
+
+
+def _run_build(header, payload, inp, out):
+    from .build import BUILD_ARTIFACTS, compose_west_command
+    from .build_db import zephyr_revision_dir
+
+    env, cwd = None, None
+    if header.get("zephyr_revision"):
+        # Revisions are set up in the workspace of the VSD repository on the worker host
+        cwd = zephyr_revision_dir(Path(__file__).parent.parent / "workspace", header["zephyr_revision"])
+        env = dict(os.environ, ZEPHYR_BASE=str(cwd / "zephyr"))
+
+    with tempfile.TemporaryDirectory(prefix="vsd-executor-") as tmp:
+        tmp = Path(tmp)
+        sources = tmp / "sources"
+        _extract(payload, sources)
+
+        # Recreate the workspace layout expected by BOARD_ROOT
+        board_dir = tmp / "workspace" / header["board_dir"]
+        os.makedirs(board_dir.parent)
+        os.rename(sources / "board", board_dir)
+
+        build_dir = tmp / "build"
+        command = compose_west_command(header["board_name"], sources / "app", build_dir,
+                                       tmp / "workspace", header.get("extra_configs"))
+        proc = subprocess.Popen(command, shell=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                start_new_session=True, env=env, cwd=cwd)
+        _abort_on_eof(inp, proc)
+
+        for line in proc.stdout:
+            _write_message(out, {"op": "log", "data": line.decode(errors="replace")})
+        proc.wait()
+
+        buf = io.BytesIO()
+        with tarfile.open(fileobj=buf, mode="w:gz") as tar:
+            for artifact in BUILD_ARTIFACTS:
+                if (build_dir / artifact).exists():
+                    tar.add(build_dir / artifact, arcname=artifact)
+        data = buf.getvalue()
+        _write_message(out, {"op": "result", "returncode": proc.returncode, "size": len(data)}, data)
+
+
+def serve(inp=None, out=None):
+    """Handle requests of a single client until the pipe is closed."""
+    inp = inp or sys.stdin.buffer
+    out = out or sys.stdout.buffer
+    while True:
+        try:
+            header, payload = _read_message(inp)
+        except EOFError:
+            return
+
+        if header["op"] == "load":
+            _write_message(out, {"op": "load", "load": os.getloadavg()[0], "cpus": os.cpu_count()})
+        elif header["op"] == "has":
+            store = object_store()
+            _write_message(out, {"op": "has", "missing": [h for h in header["hashes"] if not (store / h).exists()]})
+        elif header["op"] == "put":
+            _put_object(header, payload)
+            _write_message(out, {"op": "put"})
+        elif header["op"] in ("build", "simulate"):
+            if header["op"] == "build":
+                _run_build(header, payload, inp, out)
+            else:
+                _run_simulation(header, inp, out)
+            # The job consumes the rest of the input to detect aborts
+            return
+
+
+# Client side.
+
+class Executor():
+    """
+    Machine able to run builds and simulations with the worker. `command` starts
+    the worker with its stdin/stdout connected to the client.
+    """
+    def __init__(self, name, command, slots=1, cwd=None):
+        self.name = name
+        self.command = command
+        self.cwd = cwd
+        self.slots = slots
+        self.running = 0
+        self.uploaded = 0
+        self._load = None
+        self._load_time = 0
+        self._digests = {}
+        self._upload_lock = asyncio.Lock()
+
+    async def _start_worker(self):
+        return await asyncio.create_subprocess_exec(
+            *self.command, stdin=asyncio.subprocess.PIPE, stdout=asyncio.subprocess.PIPE, cwd=self.cwd
+        )
+
+    @staticmethod
+    async def _read_message(stream):
+        size = _HEADER.unpack(await stream.readexactly(_HEADER.size))[0]
+        header = json.loads(await stream.readexactly(size))
+        payload = await stream.readexactly(header["size"]) if "size" in header else b""
+        return header, payload
+
+    @staticmethod
+    def _send(proc, header, payload=b""):
+        data = json.dumps(header).encode()
+        proc.stdin.write(_HEADER.pack(len(data)) + data + payload)
+
+    async def load(self):
+        """Host load per CPU, cached for LOAD_TTL seconds. Unreachable executors report infinite load."""
+        if self._load is not None and time.monotonic() - self._load_time < LOAD_TTL:
+            return self._load
+
+        proc = None
+        try:
+            proc = await self._start_worker()
+            self._send(proc, {"op": "load"})
+            header, _ = await asyncio.wait_for(self._read_message(proc.stdout), 30)
+            proc.stdin.close()
+            await proc.wait()
+            self._load = header["load"] / max(header["cpus"], 1)
+        except (OSError, asyncio.IncompleteReadError, asyncio.TimeoutError) as e:
+            logging.warning(f"Executor {self.name} is unavailable: {e}")
+            self._load = float("inf")
+            if proc and proc.returncode is None:
+                proc.kill()
+                await proc.wait()
+        self._load_time = time.monotonic()
+        return self._load
+
+    async def build(self, board_name, board_dir, app_path, workspace, output_dir,
+                    extra_configs=None, print_callback=None, kill_event=None, zephyr_revision=None):
+        """
+        Run the build on the executor and extract its artifacts to `output_dir`.
+        Returns the return code of the build, its output and information if it was aborted.
+        """
+        sources = pack_build_sources(board_dir, app_path)
+        header = {
+            "op": "build",
+            "board_name": board_name,
+            "board_dir": str(Path(board_dir).relative_to(workspace)),
+            "extra_configs": extra_configs,
+            "zephyr_revision": zephyr_revision,
+            "size": len(sources),
+        }
+
+        proc = await self._start_worker()
+        self._send(proc, header, sources)
+
+        out = bytearray()
+        aborted = False
+        try:
+            while True:
+                message = await self._receive(proc, kill_event)
+                if message is None:
+                    logging.warning(f"Aborting Zephyr build on {self.name}")
+                    aborted = True
+                    return None, bytes(out), True
+
+                header, payload = message
+                if header["op"] == "log":
+                    out.extend(header["data"].encode())
+                    if print_callback:
+                        await print_callback(header["data"])
+                elif header["op"] == "result":
+                    _extract(payload, output_dir)
+                    return header["returncode"], bytes(out), False
+        except (asyncio.IncompleteReadError, ConnectionError):
+            logging.error(f"Connection with executor {self.name} was lost")
+            return -1, bytes(out), False
+        finally:
+            await self._close(proc, aborted)
+
+    async def _receive(self, proc, kill_event=None):
+        """Wait for the next message from the worker, returns None if the job was aborted."""
+        await proc.stdin.drain()
+        read_task = asyncio.ensure_future(self._read_message(proc.stdout))
+        while not read_task.done():
+            if kill_event and kill_event.is_set():
+                read_task.cancel()
+                return None
+            await asyncio.wait([read_task], timeout=0.1)
+        return read_task.result()
+
+    async def _close(self, proc, aborted=False):
+        # Closing the input stops the job on the worker side, the rest
+        # of its output is discarded until it exits
+        proc.stdin.close()
+        try:
+            await asyncio.wait_for(proc.stdout.read(), 10 if aborted else 5)
+            await proc.wait()
+        except asyncio.TimeoutError:
+            proc.kill()
+            await proc.wait()
+
+    async def _upload(self, proc, files):
+        """Send files missing in the object store of the worker. Returns {relative path: hash}."""
+        hashes = {}
+        for rel_path, path in files.items():
+            if path not in self._digests:
+                self._digests[path] = file_digest(path)
+            hashes[rel_path] = self._digests[path]
+
+        # Concurrent jobs on the same executor would upload the same files
+        async with self._upload_lock:
+            self._send(proc, {"op": "has", "hashes": sorted(set(hashes.values()))})
+            header, _ = await self._receive(proc)
+            missing = set(header["missing"])
+            for rel_path, digest in hashes.items():
+                if digest in missing:
+                    data = Path(files[rel_path]).read_bytes()
+                    self._send(proc, {"op": "put", "hash": digest, "size": len(data)}, data)
+                    await self._receive(proc)
+                    missing.discard(digest)
+                    self.uploaded += len(data)
+        return hashes
+
+    async def simulate(self, board_name, files, args=(), kill_event=None):
+        """
+        Run `simulate` command with given arguments on the executor. `files` maps
+        paths relative to the workspace of the simulation to local files.
+        Returns the return code, the console output and the wall time of the run.
+        """
+        proc = await self._start_worker()
+        aborted = False
+        try:
+            hashes = await self._upload(proc, files)
+            self._send(proc, {"op": "simulate", "board_name": board_name, "files": hashes, "args": list(args)})
+            message = await self._receive(proc, kill_event)
+            if message is None:
+                aborted = True
+                return None, b"", 0.0
+            header, payload = message
+            return header["returncode"], payload, header["wall_time"]
+        except (asyncio.IncompleteReadError, ConnectionError):
+            logging.error(f"Connection with executor {self.name} was lost")
+            return -1, b"", 0.0
+        finally:
+            await self._close(proc, aborted)
+
+
+class ExecutorPool():
+    """
+    Executors available for builds. Every build is dispatched to the executor with
+    the lowest score: builds running there per slot plus the load of its host.
+    """
+    def __init__(self, executors):
+        self.executors = executors
+        self._changed = asyncio.Condition()
+
+    async def acquire(self):
+        while True:
+            # Probing the load may take long, so it is done without holding the lock
+            loads = await asyncio.gather(*(e.load() for e in self.executors))
+            if all(load == float("inf") for load in loads):
+                raise RuntimeError("None of the build executors is available")
+
+            async with self._changed:
+                free = [(e.running / e.slots + load, e) for e, load in zip(self.executors, loads)
+                        if e.running < e.slots and load != float("inf")]
+                if free:
+                    _, executor = min(free, key=lambda t: t[0])
+                    executor.running += 1
+                    return executor
+                await self._changed.wait()
+
+    async def release(self, executor):
+        async with self._changed:
+            executor.running -= 1
+            self._changed.notify_all()
+
+
+def parse_executors(specs):
+    """
+    Create executors from comma separated list of specifications:
+        local[?slots=N]                       -- worker processes on this machine
+        ssh://[user@]host/path/to/vsd[?slots=N] -- workers started through SSH in the VSD
+                                                 repository on the remote host
+    """
+    repo_root = Path(__file__).parent.parent.absolute()
+    executors = []
+    for spec in specs.split(","):
+        url = urlparse(spec.strip())
+        slots = int(parse_qs(url.query).get("slots", [1])[0])
+        if url.scheme == "ssh":
+            # Output of the environment script would break the protocol, so it is discarded
+            remote = (f"cd {shlex.quote(url.path)} && bash -c "
+                      "'source workspace/vsd-env.sh > /dev/null && exec python3 -m scripts.executors'")
+            command = ["ssh", "-o", "BatchMode=yes", url.netloc, remote]
+            executors.append(Executor(url.netloc, command, slots))
+        elif url.path == "local":
+            # Run the worker from the repository root, so the module can be found
+            command = [sys.executable, "-m", "scripts.executors"]
+            name = f"local-{len(executors)}" if any(e.name == "local" for e in executors) else "local"
+            executors.append(Executor(name, command, slots, cwd=repo_root))
+        else:
+            raise ValueError(f"Unknown executor: '{spec}'")
+    return ExecutorPool(executors)
+
+
+if __name__ == "__main__":
+    logging.basicConfig(level=logging.WARNING, stream=sys.stderr)
+    serve()
@@ -1,8 +1,20 @@
 # Copyright (c) 2023 Antmicro
 # SPDX-License-Identifier: Apache-2.0
 
+import hashlib
+import json
 import logging
 import re
+import weakref
+
+
+# Properties which are only used to present simulation state in the frontend.
+RUNTIME_PROPERTIES = {'active'}
+
+# Properties which don't affect the firmware and can be applied to the running simulation.
+LIVE_PROPERTIES = {'temperature', 'observed'}
+
+THERMOMETER_RDP_NAMES = ['ti_tmp108', 'silabs_si7210']
 
 
 class Node():
@@ -68,6 +80,15 @@ class Node():
             return ', '.join(f'"{c}"' for c in compats)
         return None
 
+    def is_thermometer(self):
+        return self.rdp_name in THERMOMETER_RDP_NAMES
+
+    def get_property(self, name, default=None):
+        for prop in self._node.get('properties', []):
+            if prop['name'] == name:
+                return prop['value']
+        return default
+
     def get_node_interface_address(self, interface):
         if 'properties' not in self._node:
             return None
@@ -85,11 +106,58 @@ class Node():
         return None
 
 
+class Subgraph():
+    """
+    Group of nodes defined once in the graph file and instantiated many times:
+        "subgraphs": [{"name": "sensor_cluster", "nodes": [...],
+                       "ports": [{"name": "gpio", "node": "<node id>", "interface": "gpio"}, ...]}]
+    Nodes use the same format as graph nodes. Ports are interfaces of the nodes
+    connected to the SoC by instances; many nodes can share the port name.
+    """
+    def __init__(self, definition, digest, specification):
+        self.name = definition['name']
+        self.digest = digest
+        nodes = {node['id']: Node(node, specification) for node in definition['nodes']}
+        self.ports = [(port['name'], nodes[port['node']], port['interface']) for port in definition['ports']]
+        # Device tree snippets of the nodes, generated by the build on first use
+        self.fragments = None
+
+
+class SubgraphInstance():
+    """
+    Subgraph used in the graph:
+        "instances": [{"id": "cluster_a", "subgraph": "sensor_cluster",
+                       "ports": {"gpio": "<SoC interface id>", "i2c": "<SoC interface id>"},
+                       "parameters": {"address_offset": "0x2"}}]
+    The address offset is added to addresses of all nodes of the instance.
+    """
+    def __init__(self, instance, subgraph):
+        self.id = instance['id']
+        self.subgraph = subgraph
+        self.ports = instance.get('ports', {})
+        self.address_offset = int(str(instance.get('parameters', {}).get('address_offset', 0)), 0)
+        self.suffix = re.sub(r'\W', '_', self.id).lower()
+
+
+# Subgraphs parsed with each specification, by the hash of their definitions
+_subgraphs = weakref.WeakKeyDictionary()
+
+
+def _parse_subgraph(definition, specification):
+    digest = hashlib.sha256(json.dumps(definition, sort_keys=True).encode()).hexdigest()
+    cache = _subgraphs.setdefault(specification, {})
+    if digest not in cache:
+        cache[digest] = Subgraph(definition, digest, specification)
+    return cache[digest]
+
+
 class Graph():
     def __init__(self, graph_json, specification):
+        self._graph_json = graph_json
         self.nodes = {}
         self.socs = []
         self.interface_to_node = {}
+        self.instances = []
 
         for graph_node in graph_json['graph']['nodes']:
             node_id = graph_node['id']
@@ -123,6 +191,39 @@ class Graph():
             self.nodes[node_from].connections[id_from].append(id_to)
             self.nodes[node_to].connections[id_to].append(id_from)
 
+        subgraphs = {d['name']: _parse_subgraph(d, specification) for d in graph_json.get('subgraphs', [])}
+        for instance in graph_json['graph'].get('instances', []):
+            if instance['subgraph'] not in subgraphs:
+                raise KeyError(f"Subgraph '{instance['subgraph']}' of instance {instance['id']} isn't defined")
+            self.instances.append(SubgraphInstance(instance, subgraphs[instance['subgraph']]))
+
+    @property
+    def fingerprint(self):
+        """
+        Hash of the graph content that affects the firmware. It doesn't depend
+        on the node layout nor on the properties that can be changed live.
+        """
+        nodes = []
+        for node in self._graph_json['graph']['nodes']:
+            nodes.append({
+                'id': node['id'],
+                'name': node.get('name'),
+                'interfaces': sorted((i['id'], i['name']) for i in node.get('interfaces', [])),
+                'properties': sorted(
+                    (p['name'], str(p['value'])) for p in node.get('properties', [])
+                    if p['name'] not in RUNTIME_PROPERTIES | LIVE_PROPERTIES
+                ),
+            })
+        connections = sorted((e['from'], e['to']) for e in self._graph_json['graph']['connections'])
+        instances = sorted(
+            (i.id, i.subgraph.digest, sorted(i.ports.items()), i.address_offset) for i in self.instances
+        )
+
+        content = json.dumps({'nodes': sorted(nodes, key=lambda n: n['id']), 'connections': connections})
+        if instances:
+            content += json.dumps(instances)
+        return hashlib.sha256(content.encode()).hexdigest()
+
     def get_soc_with_connections(self):
         if len(self.socs) == 0:
             raise KeyError("Haven't found any SoC nodes in the graph")
@@ -141,3 +242,33 @@ class Graph():
                 node_interface_name = neighbor_node.interfaces[n]
                 connections.append((soc_interface_name, node_interface_name, neighbor_node))
         return soc_node, connections
+
+    def get_instance_connections(self):
+        """Return (instance, {port name: SoC interface name}) tuples for instances of subgraphs."""
+        soc_node = self.nodes[self.socs[0]]
+        result = []
+        for instance in self.instances:
+            ports = {}
+            for port, interface_id in instance.ports.items():
+                if interface_id not in soc_node.interfaces:
+                    logging.warning(f"Port {port} of {instance.id} isn't connected to the SoC, skipping.")
+                    continue
+                ports[port] = soc_node.interfaces[interface_id]
+            result.append((instance, ports))
+        return result
+
+
+def live_changes(old_graph, new_graph):
+    """
+    Return live properties that differ between graphs as (node, name, value) tuples.
+    Graphs are expected to have the same fingerprint, so they share the nodes.
+    If there is no old graph, all live properties set in the new one are returned.
+    """
+    changes = []
+    for node_id, node in new_graph.nodes.items():
+        old_node = old_graph.nodes.get(node_id) if old_graph else None
+        for name in LIVE_PROPERTIES:
+            value = node.get_property(name)
+            if value is not None and (old_node is None or old_node.get_property(name) != value):
+                changes.append((node, name, value))
+    return changes
@@ -0,0 +1,184 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import contextlib
+import fcntl
+import json
+import logging
+import os
+import signal
+import subprocess
+
+from pathlib import Path
+
+
+# Priority class: (rank, nice value, ionice class, ionice level). Lower rank is more important.
+PRIORITIES = {
+    "interactive": (0, 0, 2, 0),
+    "speculative": (1, 10, 2, 7),
+    "batch": (2, 19, 3, 0),
+}
+
+PREEMPT_POLICIES = ("none", "pause", "cancel")
+
+
+def _rank(priority):
+    if priority not in PRIORITIES:
+        raise ValueError(f"Unknown priority '{priority}', use one of: {', '.join(PRIORITIES)}")
+    return PRIORITIES[priority][0]
+
+
+def _outranks(preemptor, job):
+    # Jobs building the same board hold its locks, pausing them would block the preemptor
+    if preemptor["board"] and preemptor["board"] == job["board"]:
+        return False
+    return _rank(preemptor["priority"]) < _rank(job["priority"])
+
+
+def throttle_command(command, priority):
+    """Prefix the shell command, so it runs with CPU and I/O priority of the class."""
+    _rank(priority)
+    _, nice, io_class, io_level = PRIORITIES[priority]
+    if nice == 0:
+        return command
+    io_args = f"-c {io_class}" if io_class == 3 else f"-c {io_class} -n {io_level}"
+    return f"nice -n {nice} ionice {io_args} {command}"
+
+
+def throttle_process(priority):
+    """Set CPU and I/O priority of the current process (inherited by its children)."""
+    _rank(priority)
+    _, nice, io_class, io_level = PRIORITIES[priority]
+    if nice == 0:
+        return
+    os.setpriority(os.PRIO_PROCESS, 0, nice)
+    io_args = ["-c", str(io_class)] if io_class == 3 else ["-c", str(io_class), "-n", str(io_level)]
+    try:
+        subprocess.run(["ionice", *io_args, "-p", str(os.getpid())], check=False)
+    except FileNotFoundError:
+        logging.debug("ionice not found, I/O priority not changed")
+
+
+def _start_time(pid):
+    """Start time of the process in clock ticks since boot, identifies it if the PID gets reused."""
+    try:
+        stat = Path(f"/proc/{pid}/stat").read_text()
+    except (FileNotFoundError, ProcessLookupError):
+        return None
+    # Fields are counted after the command name, which can contain spaces
+    return int(stat.rsplit(")", 1)[1].split()[19])
+
+
+class JobRegistry():
+    """
+    Jobs running in the workspace with their priority classes, one file per job
+    in `workspace/jobs`. Jobs which preempt others record the policy, so jobs
+    of lower priority started later are paused or cancelled right away too.
+    """
+    def __init__(self, workspace):
+        self.path = Path(workspace) / "jobs"
+        os.makedirs(self.path, exist_ok=True)
+
+    @contextlib.contextmanager
+    def _locked(self):
+        with open(self.path / ".lock", "a") as f:
+            fcntl.flock(f, fcntl.LOCK_EX)
+            try:
+                yield
+            finally:
+                fcntl.flock(f, fcntl.LOCK_UN)
+
+    def jobs(self):
+        """Return entries of living jobs and drop entries of dead ones."""
+        jobs = []
+        for path in self.path.glob("*.json"):
+            try:
+                job = json.loads(path.read_text())
+            except (FileNotFoundError, json.JSONDecodeError):
+                continue
+            if not _alive(job):
+                path.unlink(missing_ok=True)
+                continue
+            job["path"] = path
+            jobs.append(job)
+        return jobs
+
+    def register(self, priority, pid, group=False, board=None, preempt="none"):
+        """
+        Register the process (or the process group led by it) as a job.
+        Returns the path of the entry which has to be passed to `unregister`.
+        """
+        if preempt not in PREEMPT_POLICIES:
+            raise ValueError(f"Unknown preemption policy '{preempt}', use one of: {', '.join(PREEMPT_POLICIES)}")
+        _rank(priority)
+        entry = {"pid": pid, "start_time": _start_time(pid), "group": group, "priority": priority,
+                 "board": board, "preempt": preempt}
+        path = self.path / f"{os.getpid()}-{pid}.json"
+        action = None
+        with self._locked():
+            path.write_text(json.dumps(entry))
+            for job in self.jobs():
+                if job["preempt"] != "none" and _outranks(job, entry):
+                    action = signal.SIGTERM if job["preempt"] == "cancel" else signal.SIGSTOP
+            if preempt != "none":
+                self._preempt(entry)
+
+        # The job may be the current process, so it is stopped after releasing the lock
+        if action is not None:
+            logging.info(f"Job of higher priority is running, {'cancelling' if action == signal.SIGTERM else 'pausing'} this job")
+            _signal(entry, action)
+        return path
+
+    def unregister(self, path):
+        with self._locked():
+            path.unlink(missing_ok=True)
+            self._resume()
+
+    def _preempt(self, preemptor):
+        for job in self.jobs():
+            if not _outranks(preemptor, job):
+                continue
+            if preemptor["preempt"] == "cancel":
+                logging.info(f"Cancelling {job['priority']} job {job['pid']}")
+                _signal(job, signal.SIGTERM)
+            else:
+                logging.info(f"Pausing {job['priority']} job {job['pid']}")
+                _signal(job, signal.SIGSTOP)
+
+    def _resume(self):
+        """Continue paused jobs not outranked by any of the remaining preempting jobs."""
+        jobs = self.jobs()
+        preemptors = [j for j in jobs if j["preempt"] == "pause"]
+        for job in jobs:
+            if not any(_outranks(p, job) for p in preemptors):
+                _signal(job, signal.SIGCONT)
+
+
+def _alive(job):
+    """Check that the process of the entry runs and its PID wasn't reused by another one."""
+    start_time = _start_time(job["pid"])
+    return start_time is not None and start_time == job.get("start_time")
+
+
+def _signal(job, sig):
+    if not _alive(job):
+        return
+    with contextlib.suppress(ProcessLookupError):
+        if job["group"]:
+            os.killpg(job["pid"], sig)
+        else:
+            os.kill(job["pid"], sig)
+
+
+@contextlib.contextmanager
+def registered_job(workspace, priority, pid=None, group=False, board=None, preempt="none"):
+    """Keep the job registered for the duration of the block."""
+    if priority is None:
+        yield
+        return
+    registry = JobRegistry(workspace)
+    path = registry.register(priority, pid or os.getpid(), group, board, preempt)
+    try:
+        yield
+    finally:
+        registry.unregister(path)
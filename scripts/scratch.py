@@ -0,0 +1,136 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+import os
+import queue
+import shutil
+import threading
+
+from pathlib import Path
+
+from .build_db import publish_dir, staging_dir, workspace_lock
+from .workspace_gc import _dir_size, format_size
+
+
+def _cache_file_dir(build_dir):
+    """Directory the CMake build tree was configured in (build trees can't be moved)."""
+    try:
+        with open(build_dir / "CMakeCache.txt") as f:
+            for line in f:
+                if line.startswith("CMAKE_CACHEFILE_DIR:"):
+                    return Path(line.split("=", 1)[1].strip())
+    except FileNotFoundError:
+        pass
+    return None
+
+
+class ScratchSpace():
+    """
+    Build trees kept in a fast scratch directory (e.g. tmpfs) instead of the workspace.
+
+    After a build, its tree is copied to the workspace (`workspace/build-<name>`)
+    by a background thread, so the build doesn't wait for the slow storage.
+    Trees evicted from the scratch directory to keep it in the memory budget
+    are restored from the workspace copy when the board is built again.
+
+    All operations on a tree are done with the `build-<name>` workspace lock held.
+    """
+    def __init__(self, workspace, path, budget=None):
+        self.workspace = Path(workspace)
+        self.path = Path(path).absolute()
+        self.budget = budget
+        os.makedirs(self.path, exist_ok=True)
+
+        self._queue = queue.Queue()
+        self._thread = threading.Thread(target=self._persist_loop, daemon=True)
+        self._thread.start()
+
+    def build_dir(self, name):
+        return self.path / f"build-{name}"
+
+    def persisted_dir(self, name):
+        return self.workspace / f"build-{name}"
+
+    def _marker(self, name):
+        # Present when the workspace copy is up to date with the tree in the scratch directory
+        return self.path / f"build-{name}.persisted"
+
+    def restore(self, name):
+        """Make the tree available in the scratch directory. Returns False if there is no warm tree."""
+        self.fit_budget(exclude=name)
+        build_dir = self.build_dir(name)
+        if build_dir.exists():
+            return True
+
+        persisted = self.persisted_dir(name)
+        if _cache_file_dir(persisted) != build_dir:
+            return False
+
+        logging.info(f"Restoring build tree from {persisted} to {build_dir}")
+        shutil.copytree(persisted, build_dir, symlinks=True)
+        self._marker(name).touch()
+        return True
+
+    def built(self, name):
+        """Schedule copying the tree to the workspace."""
+        # Modification time of the tree orders the eviction
+        os.utime(self.build_dir(name))
+        self._marker(name).unlink(missing_ok=True)
+        self._queue.put(name)
+
+    def close(self):
+        """Wait until all trees are copied to the workspace."""
+        self._queue.join()
+
+    def _persist_loop(self):
+        while True:
+            name = self._queue.get()
+            try:
+                with workspace_lock(self.workspace, f"build-{name}"):
+                    self._persist(name)
+                self.fit_budget()
+            except Exception as e:
+                logging.error(f"Failed to save build tree {name} in the workspace: {e}")
+            finally:
+                self._queue.task_done()
+
+    def _persist(self, name):
+        build_dir = self.build_dir(name)
+        if self._marker(name).exists() or not build_dir.exists():
+            return
+
+        staging = staging_dir(self.workspace, f"build-{name}")
+        shutil.copytree(build_dir, staging / build_dir.name, symlinks=True)
+        publish_dir(staging / build_dir.name, self.persisted_dir(name))
+        shutil.rmtree(staging)
+        self._marker(name).touch()
+        logging.debug(f"Build tree {name} saved in {self.persisted_dir(name)}")
+
+    def fit_budget(self, exclude=None):
+        """Evict least recently built trees not used at the moment until the scratch directory fits in the budget."""
+        if self.budget is None:
+            return
+
+        trees = [(d, _dir_size(d)) for d in self.path.glob("build-*") if d.is_dir()]
+        total = sum(size for _, size in trees)
+        for build_dir, size in sorted(trees, key=lambda t: t[0].stat().st_mtime):
+            if total <= self.budget:
+                break
+            name = build_dir.name[len("build-"):]
+            if name == exclude:
+                continue
+            try:
+                with workspace_lock(self.workspace, f"build-{name}", blocking=False):
+                    if not build_dir.exists():
+                        continue
+                    self._persist(name)
+                    shutil.rmtree(build_dir)
+                    total -= size
+                    logging.info(f"Evicted build tree {name} ({format_size(size)}) from {self.path}")
+            except BlockingIOError:
+                continue
+
+        if total > self.budget:
+            logging.warning(f"Build trees in {self.path} use {format_size(total)}, "
+                            f"over the budget of {format_size(self.budget)}")
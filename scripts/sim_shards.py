@@ -0,0 +1,203 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import asyncio
+import collections
+import json
+import logging
+import os
+import re
+import sys
+import time
+
+from pathlib import Path
+
+from .elf_image import load_image_path, symbols_path
+from .executors import parse_executors
+
+
+class SimulationJob():
+    """
+    Single simulation of the regression set, described in the jobs file as:
+        {"name": "hot", "board": "demo_blinky_temp", "duration": 10,
+         "stimulus": "hot.json", "input_script": "input.txt", "expect": "Temperature: 3\\d"}
+    Paths are relative to the jobs file; `expect` is a regular expression that
+    has to match the console output for the job to pass.
+    """
+    def __init__(self, spec, base_dir, index):
+        self.board = spec["board"]
+        self.name = spec.get("name", f"{self.board}-{index}")
+        # Names are used in paths of logs and scenario files
+        if not isinstance(self.name, str) or not re.fullmatch(r"[^/\\]+", self.name) or self.name in (".", ".."):
+            raise ValueError(f"Invalid job name '{self.name}'")
+        self.duration = float(spec.get("duration", 10))
+        self.instances = int(spec.get("instances", 1))
+        self.expect = spec.get("expect")
+        self.stimulus = base_dir / spec["stimulus"] if "stimulus" in spec else None
+        self.input_script = base_dir / spec["input_script"] if "input_script" in spec else None
+
+    def files(self, workspace):
+        """Return files needed to run the job, keyed by path relative to the workspace."""
+        builds_dir = workspace / "builds" / self.board
+        elf_path = builds_dir / "zephyr/zephyr.elf"
+        paths = [
+            builds_dir / f"{self.board}.repl",
+            builds_dir / "zephyr/zephyr.dts",
+            elf_path,
+            load_image_path(elf_path),
+            symbols_path(elf_path),
+        ]
+        files = {str(p.relative_to(workspace)): p for p in paths if p.exists()}
+        if self.stimulus:
+            files[f"scenarios/{self.name}/{self.stimulus.name}"] = self.stimulus
+        if self.input_script:
+            files[f"scenarios/{self.name}/{self.input_script.name}"] = self.input_script
+        return files
+
+    def args(self):
+        args = ["--duration", str(self.duration), "--instances", str(self.instances)]
+        if self.stimulus:
+            args += ["--stimulus", f"{{workdir}}/scenarios/{self.name}/{self.stimulus.name}"]
+        if self.input_script:
+            args += ["--input-script", f"{{workdir}}/scenarios/{self.name}/{self.input_script.name}"]
+        return args
+
+
+class ShardScheduler():
+    """
+    Runs simulation jobs on all slots of the executors.
+
+    Jobs of a board are initially assigned to the same executor, so its artifacts
+    are transferred to as few hosts as possible, and spread over the slots of that
+    executor. A slot which runs out of jobs steals from the back of the longest
+    queue, preferring slots of its own executor.
+    """
+    def __init__(self, executors, jobs):
+        self.slots = [(executor, i) for executor in executors for i in range(executor.slots)]
+        self.queues = {slot: collections.deque() for slot in self.slots}
+        self.stolen = 0
+
+        by_board = collections.defaultdict(list)
+        for job in jobs:
+            by_board[job.board].append(job)
+
+        # Biggest groups first, each to the executor with the least work per slot
+        work = {executor: 0.0 for executor in executors}
+        for board, group in sorted(by_board.items(), key=lambda t: -sum(j.duration for j in t[1])):
+            executor = min(executors, key=lambda e: work[e] / e.slots)
+            work[executor] += sum(j.duration for j in group)
+            slots = [s for s in self.slots if s[0] is executor]
+            for job in sorted(group, key=lambda j: -j.duration):
+                slot = min(slots, key=lambda s: sum(j.duration for j in self.queues[s]))
+                self.queues[slot].append(job)
+
+    def next_job(self, slot):
+        if self.queues[slot]:
+            return self.queues[slot].popleft()
+
+        executor = slot[0]
+        candidates = [s for s in self.slots if self.queues[s]]
+        if not candidates:
+            return None
+        victim = max(candidates, key=lambda s: (s[0] is executor, len(self.queues[s])))
+        self.stolen += 1
+        return self.queues[victim].pop()
+
+    async def run(self, run_job):
+        async def run_slot(slot):
+            results = []
+            while (job := self.next_job(slot)) is not None:
+                results.append(await run_job(slot[0], job))
+            return results
+
+        results = await asyncio.gather(*(run_slot(slot) for slot in self.slots))
+        return [r for slot_results in results for r in slot_results]
+
+
+def simulate_shards(jobs_file: Path,
+                    workers: str = "local",
+                    workspace: Path = Path("workspace"),
+                    report: Path = None,
+                    priority: str = None):
+    """
+    Run simulations listed in the jobs file on the given workers (same format as
+    --executors of build-zephyr) and merge their results into one report.
+    With --priority, the simulations run with the priority class (see simulate).
+    """
+    with open(jobs_file) as f:
+        specs = json.load(f)
+    try:
+        jobs = [SimulationJob(spec, jobs_file.parent, i) for i, spec in enumerate(specs)]
+    except ValueError as e:
+        logging.error(e)
+        sys.exit(1)
+    duplicates = [name for name, count in collections.Counter(job.name for job in jobs).items() if count > 1]
+    if duplicates:
+        logging.error(f"Duplicate job names in {jobs_file}: {', '.join(duplicates)}")
+        sys.exit(1)
+
+    output_dir = workspace / "shards"
+    os.makedirs(output_dir, exist_ok=True)
+    report = report or output_dir / "report.json"
+
+    async def run_job(executor, job):
+        files = job.files(workspace)
+        if f"builds/{job.board}/zephyr/zephyr.elf" not in files:
+            logging.error(f"{job.name}: board {job.board} isn't built")
+            return {"name": job.name, "board": job.board, "worker": None, "status": "error"}
+
+        logging.info(f"{job.name}: running on {executor.name}")
+        args = job.args() + (["--priority", priority] if priority else [])
+        returncode, console, wall_time = await executor.simulate(job.board, files, args)
+
+        log_path = output_dir / f"{job.name}.log"
+        log_path.write_bytes(console)
+        if returncode != 0:
+            status = "error"
+        elif job.expect and not re.search(job.expect, console.decode(errors="replace")):
+            status = "failed"
+        else:
+            status = "passed"
+
+        logging.info(f"{job.name}: {status} in {wall_time:.1f}s")
+        return {
+            "name": job.name,
+            "board": job.board,
+            "worker": executor.name,
+            "status": status,
+            "returncode": returncode,
+            "virtual_time": job.duration,
+            "wall_time": wall_time,
+            "log": str(log_path),
+        }
+
+    async def run():
+        pool = parse_executors(workers)
+        loads = await asyncio.gather(*(e.load() for e in pool.executors))
+        executors = [e for e, load in zip(pool.executors, loads) if load != float("inf")]
+        if not executors:
+            raise RuntimeError("None of the workers is available")
+
+        scheduler = ShardScheduler(executors, jobs)
+        start = time.perf_counter()
+        results = await scheduler.run(run_job)
+        return {
+            "wall_time": time.perf_counter() - start,
+            "stolen_jobs": scheduler.stolen,
+            "uploaded_bytes": {e.name: e.uploaded for e in executors},
+            "jobs": sorted(results, key=lambda r: r["name"]),
+        }
+
+    merged = asyncio.run(run())
+    with open(report, "w") as f:
+        json.dump(merged, f, indent=4)
+
+    for r in merged["jobs"]:
+        wall_time = f"{r['wall_time']:.1f}s" if "wall_time" in r else "-"
+        print(f"{r['status']:<8} {r['name']:<32} {r['board']:<24} {r['worker'] or '-':<16} {wall_time:>8}")
+
+    passed = sum(1 for r in merged["jobs"] if r["status"] == "passed")
+    print(f"{passed}/{len(merged['jobs'])} jobs passed in {merged['wall_time']:.1f}s "
+          f"({merged['stolen_jobs']} stolen). Report saved in {report}")
+    if passed != len(merged["jobs"]):
+        sys.exit(1)
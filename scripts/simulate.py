@@ -2,14 +2,27 @@
 # SPDX-License-Identifier: Apache-2.0
 
 import argparse
+import contextvars
+import json
 import logging
+import os
 import re
 import shutil
+import signal
+import statistics
 import sys
+import threading
+import time
+
+from concurrent.futures import ThreadPoolExecutor
 
 from pathlib import Path
 from dts2repl import dts2repl
 
+from .build_db import BuildDatabase, staging_dir
+from .checkpoints import CheckpointStore
+from .elf_image import load_image_path, prepare_fast_load_files, symbols_path
+
 
 def _prepare_from_template(format, template, dest):
     with open(template) as f:
@@ -67,19 +80,335 @@ def prepare_renode_files(board_name: str,
         logging.error("Failed to create REPL file")
         return 1
 
+    try:
+        prepare_fast_load_files(elf_path)
+    except (OSError, ValueError) as e:
+        logging.warning(f"Failed to create fast load image, full ELF will be used: {e}")
+
     logging.info(f"Renode files for board {board_name} are ready in {builds_dir}")
     return 0
 
 
-def prepare_simulation(board_name, elf_path, repl_path):
+def monitor_execute(command):
+    from pyrenode3.wrappers import Monitor
+    out, err = Monitor().execute(command)
+    if err:
+        raise RuntimeError(f"Renode command '{command}' failed: {err}")
+    return out
+
+
+# Monitor keeps the selected machine as its state, so commands for different
+# machines (e.g. from many backend sessions) can't be interleaved
+_machine_lock = threading.RLock()
+
+
+def machine_execute(machine_name, command):
+    with _machine_lock:
+        monitor_execute(f'mach set "{machine_name}"')
+        return monitor_execute(command)
+
+
+def load_symbols(machine_name, elf_path):
+    """Load symbols of the firmware, needed only for profiling and debugging."""
+    sym_path = symbols_path(elf_path)
+    if not sym_path.exists():
+        sym_path = elf_path
+    start = time.perf_counter()
+    machine_execute(machine_name, f"sysbus LoadSymbolsFrom @{sym_path.absolute()}")
+    logging.info(f"Symbols loaded from {sym_path.name} in {time.perf_counter() - start:.3f}s")
+
+
+def prepare_simulation(board_name, elf_path, repl_path, fast_load=True, with_symbols=False,
+                       machine_name='machine0'):
+    """
+    Create machine running the firmware in the current emulation.
+
+    If the fast load image is available it is used instead of the full debug ELF
+    and symbols are loaded separately only when `with_symbols` is set.
+    """
     from pyrenode3.wrappers import Emulation
+    start = time.perf_counter()
+
     emu = Emulation()
-    machine = emu.add_mach('machine0')
-    machine.load_repl(str(repl_path.absolute()))
-    machine.load_elf(str(elf_path.absolute()))
+    machine = emu.add_mach(machine_name)
+    try:
+        machine.load_repl(str(repl_path.absolute()))
+
+        image_path = load_image_path(elf_path)
+        if fast_load and image_path.exists():
+            machine.load_elf(str(image_path.absolute()))
+            if with_symbols:
+                load_symbols(machine_name, elf_path)
+        else:
+            image_path = elf_path
+            machine.load_elf(str(elf_path.absolute()))
+    except Exception:
+        # The emulation is reused, half-prepared machine would stay in it
+        emu.internal.RemoveMachine(machine.internal)
+        raise
+
+    logging.debug(f"Machine prepared from {image_path.name} in {time.perf_counter() - start:.3f}s")
     return emu, machine
 
 
+def compare_load_times(board_name, elf_path, repl_path, runs=3):
+    """Return median times of preparing the machine from the full ELF and from the fast load image."""
+    def prepare(fast_load):
+        start = time.perf_counter()
+        emu, _ = prepare_simulation(board_name, elf_path, repl_path, fast_load)
+        elapsed = time.perf_counter() - start
+        emu.clear()
+        return elapsed
+
+    # Warm-up run takes the cost of JIT compilation and cold page cache, it isn't counted
+    prepare(True)
+    prepare(False)
+    samples = {False: [], True: []}
+    for i in range(runs):
+        # Paths alternate their order, so neither always runs right after the other
+        for fast_load in ((False, True) if i % 2 == 0 else (True, False)):
+            samples[fast_load].append(prepare(fast_load))
+    return statistics.median(samples[False]), statistics.median(samples[True])
+
+
+def reset_emulation_settings(emu):
+    """Restore emulation-wide settings changed by SimulationControl, they outlive its machines."""
+    emu.internal.SetGlobalAdvanceImmediately(False)
+
+
+def start_machine(emu, machine):
+    """Start single machine, leaving other machines in the emulation untouched."""
+    # Starting master time source that is already running is a no-op.
+    emu.internal.MasterTimeSource.Start()
+    machine.internal.Start()
+
+
+class TeardownWorker():
+    """
+    Removes finished machines from the emulation in a background thread.
+
+    The machine is paused immediately, so it stops producing output, while
+    disposing of its peripherals happens off the event loop. The emulation
+    itself stays alive, so the next simulation can be created right away.
+    """
+    def __init__(self):
+        self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="vsd-teardown")
+
+    def _remove(self, emu, machine, name):
+        start = time.perf_counter()
+        emu.internal.RemoveMachine(machine.internal)
+        if emu.internal.MachinesCount == 0:
+            reset_emulation_settings(emu)
+        logging.debug(f"Machine {name} removed in {time.perf_counter() - start:.3f}s")
+
+    def remove(self, emu, machine, name):
+        machine.internal.Pause()
+        # The worker is shared, logs should be attributed to the caller (e.g. its session)
+        return self._executor.submit(contextvars.copy_context().run, self._remove, emu, machine, name)
+
+    def shutdown(self):
+        self._executor.shutdown(wait=True)
+
+
+def _time_interval(seconds):
+    minutes, seconds = divmod(seconds, 60)
+    hours, minutes = divmod(int(minutes), 60)
+    return f"{hours:02}:{minutes:02}:{seconds:09.6f}"
+
+
+class SimulationControl():
+    """
+    Controls execution of a running emulation: pausing, stepping by virtual time,
+    limiting the ratio of virtual time to host time (real-time factor) and
+    taking periodic checkpoints.
+
+    Pausing affects only the controlled machine, but stepping and speed limits
+    are applied to the virtual time of the whole emulation.
+
+    Renode natively either keeps virtual time in sync with the host (factor 1)
+    or advances it immediately when CPUs are idle (no limit). Other factors and
+    checkpoints are achieved by a driver thread, which runs the emulation in
+    slices of virtual time, sleeps between them and saves the emulation state.
+    """
+    # Virtual time executed at once by the driver thread
+    SLICE = 0.01
+
+    def __init__(self, emu, machine, machine_name, checkpoints=None):
+        self.emu = emu
+        self.machine = machine
+        self.machine_name = machine_name
+        self.checkpoints = checkpoints
+        # Emulation can be shared with other simulations which already changed the speed
+        self.speed = None if emu.internal.MasterTimeSource.AdvanceImmediately else 1.0
+        self.paused = True
+        self._lock = threading.RLock()
+        self._driver_thread = None
+        self._driver_stop = threading.Event()
+        # Driver threads log in the context of the creator of the control, whoever (re)starts them
+        self._context = contextvars.copy_context()
+        self._next_checkpoint = 0.0
+
+    def virtual_time(self):
+        return self.emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds
+
+    def _run_for(self, seconds):
+        with self._lock:
+            monitor_execute(f'emulation RunFor "{_time_interval(seconds)}"')
+
+    def _save_checkpoint(self, virtual_time):
+        path = self.checkpoints.checkpoint_path(virtual_time)
+        start = time.perf_counter()
+        with self._lock:
+            monitor_execute(f"Save @{path.absolute()}")
+        logging.debug(f"Checkpoint at {virtual_time:.3f}s saved in {time.perf_counter() - start:.3f}s")
+        self.checkpoints.trim()
+
+    def _drive(self):
+        throttled = self.speed not in (None, 1.0)
+        while not self._driver_stop.is_set():
+            now = self.virtual_time()
+            if self.checkpoints and now >= self._next_checkpoint:
+                self._save_checkpoint(now)
+                self._next_checkpoint = now + self.checkpoints.interval
+
+            # Short slices let pause, speed changes and close stop the driver quickly
+            period = self.SLICE
+            if self.checkpoints:
+                period = min(period, self._next_checkpoint - now)
+
+            start = time.perf_counter()
+            self._run_for(period)
+            if throttled:
+                delay = period / self.speed - (time.perf_counter() - start)
+                if delay > 0:
+                    self._driver_stop.wait(delay)
+
+    def _stop_driver(self):
+        if self._driver_thread:
+            self._driver_stop.set()
+            self._driver_thread.join()
+            self._driver_thread = None
+
+    def start(self):
+        # Driver thread takes the lock, so it must be stopped before acquiring it
+        self._stop_driver()
+        with self._lock:
+            self.paused = False
+            if self.speed in (None, 1.0) and not self.checkpoints:
+                start_machine(self.emu, self.machine)
+                return
+
+            self._driver_stop.clear()
+            self._driver_thread = threading.Thread(target=self._context.copy().run, args=(self._drive,),
+                                                   daemon=True)
+            self._driver_thread.start()
+
+    def pause(self):
+        self._stop_driver()
+        with self._lock:
+            self.machine.internal.Pause()
+            self.paused = True
+
+    def resume(self):
+        if self.paused:
+            self.start()
+
+    def stop_checkpoints(self):
+        """Stop taking checkpoints, e.g. when other simulations start in the same emulation."""
+        if not self.checkpoints:
+            return
+        was_running = not self.paused
+        self.pause()
+        self.checkpoints = None
+        if was_running:
+            self.start()
+
+    def step(self, seconds):
+        """Execute given amount of virtual time and stay paused. Blocks until it's done."""
+        self.pause()
+        self._run_for(seconds)
+
+    def seek(self, virtual_time):
+        """
+        Restore the latest checkpoint taken before given time and run the rest.
+        The emulation is replaced by the restored one, so machines have to be
+        looked up again and callbacks registered on their peripherals once more.
+        Returns the new emulation; simulation stays paused.
+        """
+        from pyrenode3.wrappers import Emulation
+        if not self.checkpoints or not (found := self.checkpoints.nearest(virtual_time)):
+            raise ValueError(f"There is no checkpoint before {virtual_time}s")
+
+        self.pause()
+        checkpoint_time, path = found
+        start = time.perf_counter()
+        with self._lock:
+            monitor_execute(f"Load @{path.absolute()}")
+            self.emu = Emulation()
+            self.machine = self.emu.get_mach(self.machine_name)
+            if virtual_time > checkpoint_time:
+                self._run_for(virtual_time - checkpoint_time)
+        self._next_checkpoint = virtual_time
+        logging.info(f"Restored checkpoint from {checkpoint_time:.3f}s and reached {virtual_time:.3f}s "
+                     f"in {time.perf_counter() - start:.3f}s")
+        return self.emu
+
+    def set_speed(self, factor):
+        """
+        Set the real-time factor limit. `None` lets the emulation run as fast as
+        possible, skipping periods in which the CPUs are idle.
+        """
+        if factor is not None and factor <= 0:
+            raise ValueError("Real-time factor must be positive")
+
+        was_running = not self.paused
+        if was_running:
+            self.pause()
+        with self._lock:
+            advance = "false" if factor == 1.0 else "true"
+            monitor_execute(f"emulation SetGlobalAdvanceImmediately {advance}")
+            self.speed = factor
+        if was_running:
+            self.start()
+
+    def reload_firmware(self, elf_path, fast_load=True):
+        """
+        Load new firmware into the running machine. CPUs are reset and memories
+        cleared, while other peripherals and callbacks registered on them are kept.
+        """
+        from Antmicro.Renode.Peripherals.Memory import MappedMemory
+        was_running = not self.paused
+        self.pause()
+
+        image_path = load_image_path(elf_path)
+        if not (fast_load and image_path.exists()):
+            image_path = elf_path
+
+        start = time.perf_counter()
+        with self._lock:
+            for cpu in self.machine.internal.SystemBus.GetCPUs():
+                cpu.Reset()
+            # Data left by the old firmware (e.g. uninitialized variables) would leak into the new one
+            for memory in self.machine.internal.GetPeripheralsOfType[MappedMemory]():
+                memory.ZeroAll()
+            # Loading ELF sets up CPUs to start from the entry point of the new firmware.
+            machine_execute(self.machine_name, f"sysbus LoadELF @{image_path.absolute()}")
+        logging.info(f"Firmware reloaded from {image_path.name} in {time.perf_counter() - start:.3f}s")
+
+        if was_running:
+            self.start()
+
+    def close(self):
+        self._stop_driver()
+
+
+def set_temperature(machine, source, repl_label, value):
+    from Antmicro.Renode.Peripherals.Sensor import ITemperatureSensor
+    from System import Decimal
+    sensor = ITemperatureSensor(machine.internal[f"sysbus.{source}.{repl_label}"])
+    sensor.Temperature = Decimal(float(value))
+
+
 def register_led_callback(machine, source, repl_label, callback):
     from Antmicro.Renode.Peripherals.Miscellaneous import ILed
     led = ILed(machine.internal[f"sysbus.{source}.{repl_label}"])
@@ -128,6 +457,27 @@ def register_uart_callback(uart, callback):
     uart.CharReceived += (callback)
 
 
+class UARTInjector():
+    """Writes input to the UART of the simulated machine and collects throughput statistics."""
+    def __init__(self, uart):
+        self.uart = uart
+        self.bytes = 0
+        self.batches = 0
+        self.time = 0.0
+
+    def write(self, data):
+        start = time.perf_counter()
+        for byte in data:
+            self.uart.WriteChar(byte)
+        self.time += time.perf_counter() - start
+        self.bytes += len(data)
+        self.batches += 1
+
+    def stats(self):
+        rate = self.bytes / self.time if self.time else 0
+        return f"{self.bytes} bytes in {self.batches} batches ({rate:.0f} B/s)"
+
+
 def get_all_uarts(machine):
     from Antmicro.Renode.Peripherals.UART import IUART
     from pyrenode3 import wrappers
@@ -135,9 +485,61 @@ def get_all_uarts(machine):
     return [(u, wrappers.Peripheral(u).name) for u in uarts]
 
 
+class ConsoleWriter():
+    """
+    Buffers console output and writes it to stdout (and optionally a log file)
+    when a line is completed or after a short interval, instead of doing
+    a separate write for every character.
+    """
+    def __init__(self, log_file=None, interval=0.05):
+        self.listeners = []
+        self._buffer = []
+        self._lock = threading.Lock()
+        self._log = open(log_file, "w") if log_file else None
+        self._interval = interval
+        self._stop = threading.Event()
+        self._flusher = threading.Thread(target=self._flush_periodically, daemon=True)
+        self._flusher.start()
+
+    def write(self, text):
+        with self._lock:
+            self._buffer.append(text)
+            if "\n" not in text:
+                return
+            self._flush_locked()
+
+    def _flush_locked(self):
+        if not self._buffer:
+            return
+        data = "".join(self._buffer)
+        self._buffer.clear()
+        sys.stdout.write(data)
+        sys.stdout.flush()
+        if self._log:
+            self._log.write(data)
+        for listener in self.listeners:
+            listener(data)
+
+    def flush(self):
+        with self._lock:
+            self._flush_locked()
+
+    def _flush_periodically(self):
+        while not self._stop.wait(self._interval):
+            self.flush()
+
+    def close(self):
+        self._stop.set()
+        self._flusher.join()
+        self.flush()
+        if self._log:
+            self._log.close()
+
+
 class ConsoleCallbackPool():
-    def __init__(self):
+    def __init__(self, writer):
         self.active_uart = None
+        self.writer = writer
 
     def create_callback(self, uart, active=False):
         decoder = UTF8Decoder()
@@ -146,7 +548,7 @@ class ConsoleCallbackPool():
                 raise Exception("Can't set more than one active consoles!")
 
             self.active_uart = uart
-            return decoder.wrap_callback(lambda c: print(c, end=''))
+            return decoder.wrap_callback(self.writer.write)
 
         # If active console is already set, then just ignore all characters.
         if self.active_uart is not None:
@@ -158,42 +560,383 @@ class ConsoleCallbackPool():
                 self.active_uart = uart
             # Print only when active uart matches the current one
             if self.active_uart is uart:
-                print(char, end='')
+                self.writer.write(char)
 
         return console_callback
 
 
-def simulate(board_name: str, workdir: Path = Path("workspace")):
+class TaggedConsole():
+    """Collects console lines of a single instance and writes them with instance tag."""
+    def __init__(self, writer, tag):
+        self.writer = writer
+        self.tag = tag
+        self._line = []
+
+    def create_callback(self):
+        decoder = UTF8Decoder()
+
+        @decoder.wrap_callback
+        def callback(char):
+            self._line.append(char)
+            if char == "\n":
+                self.writer.write(f"[{self.tag}] {''.join(self._line)}")
+                self._line = []
+
+        return callback
+
+
+class CoverageTracer():
+    """
+    Traces PCs executed by the CPUs into files in `trace_dir`. Text traces grow
+    with every executed instruction, so every `interval` seconds of host time
+    tracing is restarted with new files, while the previous ones are folded into
+    the coverage bitmap and removed. Traces on disk cover at most one interval.
+    """
+    def __init__(self, elf_path, trace_dir, interval=1.0):
+        from .coverage import CoverageBitmap
+        self.bitmap = CoverageBitmap(elf_path)
+        self.trace_dir = trace_dir
+        self.interval = interval
+        self._files = {}
+        self._generation = 0
+        self._stop = threading.Event()
+        self._thread = None
+
+    def _enable(self, machine_name, cpu_name):
+        path = self.trace_dir / f"{machine_name}-{cpu_name}-{self._generation}.trace"
+        machine_execute(machine_name, f'sysbus.{cpu_name} CreateExecutionTracing "coverage" @{path.absolute()} PC')
+        self._files[(machine_name, cpu_name)] = path
+
+    def add(self, machine, machine_name):
+        """Trace all CPUs of the machine."""
+        from Antmicro.Renode.Peripherals.CPU import ICPU
+        from pyrenode3 import wrappers
+        for cpu in machine.GetPeripheralsOfType[ICPU]():
+            self._enable(machine_name, wrappers.Peripheral(cpu).name)
+
+    def _rotate(self):
+        from .coverage import fold_trace
+        self._generation += 1
+        for (machine_name, cpu_name), old in list(self._files.items()):
+            # Disabling the tracer closes its file, so it's complete
+            machine_execute(machine_name, f'sysbus.{cpu_name} DisableExecutionTracing')
+            self._enable(machine_name, cpu_name)
+            fold_trace(self.bitmap, old)
+
+    def _loop(self):
+        while not self._stop.wait(self.interval):
+            try:
+                self._rotate()
+            except Exception as e:
+                logging.warning(f"Failed to fold execution traces: {e}")
+
+    def start(self):
+        self._thread = threading.Thread(target=self._loop, daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        if self._thread:
+            self._stop.set()
+            self._thread.join()
+            self._thread = None
+
+    def finish(self):
+        """Fold the remaining traces, they are complete once the machines are disposed."""
+        from .coverage import fold_trace
+        for path in self._files.values():
+            fold_trace(self.bitmap, path)
+        return self.bitmap
+
+
+def get_temperature_sensors(machine):
+    from Antmicro.Renode.Peripherals.Sensor import ITemperatureSensor
+    return list(machine.GetPeripheralsOfType[ITemperatureSensor]())
+
+
+class StimulusPlayer():
+    """
+    Applies temperature changes to machines at given points of virtual time.
+
+    Schedule maps machine name (or "default") to list of [virtual_time, temperature]
+    pairs, e.g. `{"default": [[0, 20.0]], "machine3": [[0, 20.0], [5, 35.5]]}`.
+    """
+    def __init__(self, emu, machines, schedule, interval=0.01):
+        self.emu = emu
+        self.interval = interval
+        self._events = []
+        for name, machine in machines:
+            for t, value in sorted(schedule.get(name, schedule.get("default", []))):
+                self._events.append((t, name, machine, value))
+        self._events.sort(key=lambda e: e[0])
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+
+    def _apply(self, machine, value):
+        from System import Decimal
+        for sensor in get_temperature_sensors(machine):
+            sensor.Temperature = Decimal(float(value))
+
+    def _run(self):
+        while self._events and not self._stop.wait(self.interval):
+            now = self.emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds
+            while self._events and self._events[0][0] <= now:
+                _, name, machine, value = self._events.pop(0)
+                logging.debug(f"{name}: temperature set to {value}")
+                self._apply(machine, value)
+
+    def start(self):
+        # Values scheduled at the beginning are applied before the emulation starts
+        while self._events and self._events[0][0] <= 0:
+            _, _, machine, value = self._events.pop(0)
+            self._apply(machine, value)
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+
+
+def prepare_fleet(board_name, elf_path, repl_path, instances, fast_load=True):
+    """
+    Create emulation with many machines running the same firmware. Each machine
+    parses the platform and loads the firmware on its own, the fast load image
+    only limits loading to the segments of the firmware.
+    """
+    machines = []
+    for i in range(instances):
+        name = f"machine{i}"
+        emu, machine = prepare_simulation(board_name, elf_path, repl_path, fast_load, machine_name=name)
+        machines.append((name, machine))
+    return emu, machines
+
+
+def _max_rss_mib():
+    import resource
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024
+
+
+def simulate_fleet(board_name, builds_dir, instances, fast_load, stimulus, console, tracer=None):
+    repl_path = builds_dir / f"{board_name}.repl"
+    elf_path = builds_dir / "zephyr/zephyr.elf"
+    dts_path = builds_dir / "zephyr/zephyr.dts"
+
+    start = time.perf_counter()
+    emu, machines = prepare_fleet(board_name, elf_path, repl_path, instances, fast_load)
+    print(f"{instances} machines prepared in {time.perf_counter() - start:.3f}s "
+          f"(max RSS: {_max_rss_mib():.0f} MiB)")
+
+    zephyr_console = _find_chosen('zephyr,console', dts_path)
+    for name, machine in machines:
+        for uart, uart_name in get_all_uarts(machine):
+            if uart_name == zephyr_console:
+                register_uart_callback(uart, TaggedConsole(console, name).create_callback())
+        if tracer:
+            tracer.add(machine, name)
+
+    player = None
+    if stimulus:
+        with open(stimulus) as f:
+            player = StimulusPlayer(emu, machines, json.load(f))
+        player.start()
+
+    return emu, machines, player
+
+
+def _exit_on_signal(signum, frame):
+    raise SystemExit(128 + signum)
+
+
+def simulate(board_name: str,
+             workdir: Path = Path("workspace"),
+             fast_load: bool = True,
+             gdb_port: int = None,
+             input_script: Path = None,
+             log_file: Path = None,
+             instances: int = 1,
+             stimulus: Path = None,
+             duration: float = None,
+             checkpoint_interval: float = None,
+             checkpoint_budget: str = "1G",
+             seek: float = None,
+             coverage: bool = False,
+             cpu_load: bool = False,
+             priority: str = None,
+             cpus: str = None,
+             rtf_stats: bool = False,
+             compare_load: int = None):
+    """
+    Run simulation of the built application. With --duration, the simulation
+    stops after given amount of virtual time (headless run). With --coverage,
+    executed code is added to the coverage of the firmware (see coverage-report).
+    With --cpu-load, utilization of the CPUs and threads is reported at the end.
+    With --priority (interactive, speculative, batch), the simulation runs with
+    lower CPU and I/O priority and can be paused by interactive builds.
+    With --cpus (e.g. 0-3), the emulation runs only on the given CPUs.
+    With --rtf-stats, stability of the real-time factor is reported at the end.
+    With --compare-load N, the machine is prepared N times from the full ELF and
+    from the fast load image and the median times are printed instead of simulating.
+    """
+    from .affinity import parse_cpus, pin_process
+    from .coverage import CoverageStore
+    from .cpu_load import CPULoad, RealTimeFactor, ThreadStats, print_load_report, print_rtf_report
+    from .priority import JobRegistry, throttle_process
+    from .workspace_gc import parse_size
+
+    if priority:
+        throttle_process(priority)
+    if cpus:
+        # Renode threads are created later and inherit the affinity
+        pin_process(parse_cpus(cpus))
+
     builds_dir = workdir / 'builds' / board_name
     repl_path = builds_dir / f"{board_name}.repl"
     elf_path = builds_dir / "zephyr/zephyr.elf"
     dts_path = builds_dir / "zephyr/zephyr.dts"
 
+    if instances > 1 and (checkpoint_interval or seek is not None):
+        print("Checkpoints aren't supported in fleet mode.")
+        sys.exit(1)
+    if instances > 1 and (gdb_port is not None or input_script):
+        print("GDB server and input script aren't supported in fleet mode.")
+        sys.exit(1)
+
+    if compare_load:
+        if not load_image_path(elf_path).exists():
+            print(f"There is no fast load image for {board_name}, run prepare-renode-files first.")
+            sys.exit(1)
+        full, fast = compare_load_times(board_name, elf_path, repl_path, compare_load)
+        print(f"Machine prepared from {elf_path.name} in {full:.3f}s, "
+              f"from {load_image_path(elf_path).name} in {fast:.3f}s (median of {compare_load} runs)")
+        return
+
+    console = ConsoleWriter(log_file)
+    player = None
+    control = None
+    console_uart = None
+    # Simulations of the same board can run in parallel, each writes its own traces
+    trace_dir = staging_dir(workdir, f"traces-{board_name}") if coverage else None
+    tracer = None
+    load = None
+    thread_stats = None
+    rtf = None
+
     try:
-        emu, machine = prepare_simulation(board_name, elf_path, repl_path)
+        if coverage:
+            tracer = CoverageTracer(elf_path, trace_dir)
+        if instances > 1:
+            emu, machines, player = simulate_fleet(board_name, builds_dir, instances, fast_load, stimulus,
+                                                   console, tracer)
+        else:
+            start = time.perf_counter()
+            emu, machine = prepare_simulation(board_name, elf_path, repl_path, fast_load,
+                                              with_symbols=gdb_port is not None)
+            image_path = load_image_path(elf_path) if fast_load and load_image_path(elf_path).exists() else elf_path
+            print(f"Machine prepared from {image_path.name} in {time.perf_counter() - start:.3f}s")
+            if gdb_port is not None:
+                machine_execute('machine0', f"machine StartGdbServer {gdb_port}")
+
+            checkpoints = None
+            if checkpoint_interval or seek is not None:
+                checkpoints = CheckpointStore(builds_dir / 'checkpoints', checkpoint_interval or 1.0,
+                                              parse_size(checkpoint_budget))
+                if seek is None:
+                    # Checkpoints of the previous run could come from another firmware
+                    checkpoints.clear()
+            control = SimulationControl(emu, machine, 'machine0', checkpoints)
+
+            if seek is not None:
+                emu = control.seek(seek)
+                machine = control.machine
+                if not checkpoint_interval:
+                    control.checkpoints = None
+
+            if tracer:
+                tracer.add(machine, 'machine0')
+            machines = [('machine0', machine)]
+
+        if cpu_load:
+            load = CPULoad(emu, machines)
+            thread_stats = ThreadStats()
+            console.listeners.append(thread_stats.feed)
     except Exception as e:
         print(f"Simulation can't be prepared using {repl_path} and {elf_path}!")
         print(f"\n{e}")
+        console.close()
+        if trace_dir:
+            shutil.rmtree(trace_dir, ignore_errors=True)
         sys.exit(1)
 
-    callback_pool = ConsoleCallbackPool()
-
-    all_uarts = get_all_uarts(machine)
-    if len(all_uarts) > 0:
-        zephyr_console = _find_chosen('zephyr,console', dts_path)
-        for uart, name in get_all_uarts(machine):
-            register_uart_callback(uart, callback_pool.create_callback(uart, active=(name == zephyr_console)))
-    else:
-        print("Runing without console output")
+    if instances == 1:
+        callback_pool = ConsoleCallbackPool(console)
+
+        all_uarts = get_all_uarts(machine)
+        if len(all_uarts) > 0:
+            zephyr_console = _find_chosen('zephyr,console', dts_path)
+            for uart, name in get_all_uarts(machine):
+                register_uart_callback(uart, callback_pool.create_callback(uart, active=(name == zephyr_console)))
+                if name == zephyr_console:
+                    console_uart = uart
+        else:
+            print("Runing without console output")
+
+    # Protect artifacts used by the simulation from garbage collection
+    db = BuildDatabase(workdir)
+    lease = db.acquire_lease(builds_dir)
+    # Jobs of higher priority cancel this one with SIGTERM, exit through the cleanup below
+    signal.signal(signal.SIGTERM, _exit_on_signal)
+    job = JobRegistry(workdir).register(priority, os.getpid(), board=board_name) if priority else None
 
     print(f"Starting simulation on {board_name}. Press Ctrl+C to quit.")
     print("-----------------------------------")
-    emu.StartAll()
+    if control:
+        control.start()
+    else:
+        emu.StartAll()
+    start_time = emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds
+    if load:
+        load.reset()
+    if tracer:
+        tracer.start()
+    if rtf_stats:
+        rtf = RealTimeFactor(emu)
+        rtf.start()
+
+    if input_script:
+        if console_uart is None:
+            print("Can't find console UART, input script is ignored.")
+        else:
+            injector = UARTInjector(console_uart)
+            injector.write(input_script.read_bytes())
+            print(f"\nInput script written: {injector.stats()}")
 
     try:
-        # Just wait for signal
-        while True:
-            pass
+        # Wait for the end of the run or for signal
+        while duration is None or emu.internal.MasterTimeSource.ElapsedVirtualTime.TotalSeconds < start_time + duration:
+            time.sleep(0.1 if duration else 1)
     finally:
+        if player:
+            player.stop()
+        if control:
+            control.close()
+        if tracer:
+            tracer.stop()
+        if rtf:
+            rtf.stop()
+        if load:
+            console.flush()
+            print_load_report(load, thread_stats)
+        if rtf:
+            console.flush()
+            print_rtf_report(rtf)
         emu.clear()
+        console.close()
+        if tracer:
+            bitmap = tracer.finish()
+            CoverageStore(workdir).add(elf_path, bitmap)
+            print(f"Coverage collected: {bitmap.count()} instruction slots executed")
+        if trace_dir:
+            shutil.rmtree(trace_dir, ignore_errors=True)
+        db.release_lease(lease)
+        db.close()
+        if job:
+            JobRegistry(workdir).unregister(job)
         print("Exiting...")
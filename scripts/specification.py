@@ -33,8 +33,15 @@ class Specification():
         self.nodes = nodes
         self.categories = categories
         self.abstract = abstract
+        self._resolved = {}
 
     def get_node_spec(self, node_name):
+        # Specifications of nodes repeated in big graphs are resolved once
+        if node_name not in self._resolved:
+            self._resolved[node_name] = self._resolve_node_spec(node_name)
+        return self._resolved[node_name]
+
+    def _resolve_node_spec(self, node_name):
         if node_name in self.nodes:
             logging.debug(f"{node_name} is a node.")
             node = self.nodes[node_name]
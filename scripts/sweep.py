@@ -0,0 +1,211 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import asyncio
+import copy
+import json
+import logging
+import os
+import re
+import sys
+import time
+import uuid
+
+from pathlib import Path
+
+from .build import build_zephyr_async, prepare_zephyr_board_dir
+from .elf_image import ElfFile, PT_LOAD
+from .parse_graph import Graph
+from .specification import Specification
+
+
+PF_W = 2
+
+_CPU_LOAD_LINE = re.compile(r"^\s+(?P<cpu>\S+)\s+busy\s+(?P<busy>[\d.]+) %")
+
+
+def _interface_class(interface):
+    """Kind of the interface used to match interfaces of different SoCs, e.g. gpioa -> gpio, i2c1 -> i2c."""
+    if isinstance(interface.get("type"), str):
+        return interface["type"]
+    name = re.sub(r"\d+$", "", interface["name"].lower())
+    return "gpio" if name.startswith("gpio") else name
+
+
+def _soc_specs(specification, socs_dir):
+    """Return {rdp name: node specification} of SoCs which have Zephyr data in the resources."""
+    socs = {}
+    for name in specification.nodes:
+        spec = specification.get_node_spec(name)
+        if not spec or "SoC" not in spec.get("category", ""):
+            continue
+        rdp = spec.get("urls", {}).get("rdp")
+        if rdp and (socs_dir / rdp.split("/")[-1]).exists():
+            socs[rdp.split("/")[-1]] = spec
+    return socs
+
+
+def port_graph(graph_json, graph, soc_spec, specification):
+    """
+    Return copy of the graph with its SoC replaced by the given one, or raise
+    ValueError if the SoC lacks interfaces used by the graph. Used interfaces are
+    mapped to free interfaces of the same kind, in the order of their names.
+    """
+    soc = graph.nodes[graph.socs[0]]
+    # Both SoCs are classified the same way, using their specifications
+    current = {i["name"]: i for i in specification.get_node_spec(soc.name).get("interfaces", [])}
+    used = {i for i, neighbors in soc.connections.items() if neighbors}
+    used |= {i for instance in graph.instances for i in instance.ports.values() if i in soc.interfaces}
+
+    free = {}
+    for interface in sorted(soc_spec.get("interfaces", []), key=lambda i: i["name"]):
+        free.setdefault(_interface_class(interface), []).append(interface["name"])
+
+    mapping = {}
+    for interface_id in sorted(used, key=lambda i: soc.interfaces[i]):
+        name = soc.interfaces[interface_id]
+        kind = _interface_class(current.get(name, {"name": name}))
+        if not free.get(kind):
+            raise ValueError(f"no free {kind} interface for {soc.interfaces[interface_id]}")
+        mapping[interface_id] = free[kind].pop(0)
+
+    ported = copy.deepcopy(graph_json)
+    for node in ported["graph"]["nodes"]:
+        if node["id"] != soc.id:
+            continue
+        node["name"] = soc_spec["name"]
+        # Connected interfaces keep their IDs, so connections stay valid
+        node["interfaces"] = [{"id": i, "name": name, "direction": "inout"} for i, name in mapping.items()]
+        node["interfaces"] += [
+            {"id": str(uuid.uuid4()), "name": name, "direction": "inout"}
+            for names in free.values() for name in names
+        ]
+        node["properties"] = []
+    return ported, {soc.interfaces[i]: name for i, name in mapping.items()}
+
+
+def footprint(elf_path):
+    """Return (flash, RAM) used by the firmware: loaded contents and writable segments."""
+    elf = ElfFile(elf_path)
+    segments = [s for s in elf.segments if s["type"] == PT_LOAD]
+    flash = sum(s["filesz"] for s in segments)
+    ram = sum(s["memsz"] for s in segments if s["flags"] & PF_W)
+    return flash, ram
+
+
+async def _simulate_variant(board_name, workspace, duration, log_path):
+    vsd_path = Path(__file__).parent.parent / "vsd.py"
+    proc = await asyncio.create_subprocess_exec(
+        sys.executable, str(vsd_path), "simulate", board_name,
+        "--workdir", str(workspace), "--duration", str(duration), "--cpu-load",
+        stdout=asyncio.subprocess.PIPE, stderr=asyncio.subprocess.STDOUT,
+    )
+    out, _ = await proc.communicate()
+    log_path.write_bytes(out)
+
+    loads = [float(m.group("busy")) for m in map(_CPU_LOAD_LINE.match, out.decode(errors="replace").splitlines()) if m]
+    return proc.returncode, sum(loads) / len(loads) if loads else None
+
+
+def sweep(graph_file: Path,
+          socs: str = None,
+          workspace: Path = Path("workspace"),
+          app_path: Path = Path("demo/blinky-temperature"),
+          templates_dir: Path = Path("renode-templates"),
+          duration: float = 5.0,
+          jobs: int = 4):
+    """
+    Port the graph to every SoC with Zephyr data in the resources (or to the
+    comma separated --socs), then build the variants one by one and simulate
+    them in parallel, comparing their footprint, build time and CPU load.
+    """
+    from .simulate import prepare_renode_files
+
+    with open(graph_file) as f:
+        graph_json = json.load(f)
+    specification = Specification(workspace / "visual-system-designer-resources/components-specification.json")
+    socs_dir = workspace / "visual-system-designer-resources/zephyr-data/socs"
+    graph = Graph(graph_json, specification)
+    if not graph.socs:
+        logging.error("Haven't found any SoC nodes in the graph")
+        sys.exit(1)
+
+    candidates = _soc_specs(specification, socs_dir)
+    if socs:
+        candidates = {name: spec for name, spec in candidates.items() if name in socs.split(",")}
+
+    output_dir = workspace / "sweeps" / graph.name
+    os.makedirs(output_dir, exist_ok=True)
+    # Variants differ in the SoC only, so most of their object files can be shared
+    os.environ.setdefault("CCACHE_DIR", str((workspace / "cache" / "ccache").absolute()))
+
+    semaphore = asyncio.Semaphore(jobs)
+    # Builds competing for the CPUs would make their times incomparable
+    build_lock = asyncio.Lock()
+
+    async def run_variant(soc_name, soc_spec, result):
+        try:
+            ported, mapping = port_graph(graph_json, graph, soc_spec, specification)
+        except ValueError as e:
+            result["reason"] = str(e)
+            return result
+        result["interfaces"] = mapping
+
+        board_name = f"{graph.name}_{soc_name}"
+        ported["graph"]["name"] = board_name
+        variant = Graph(ported, specification)
+        soc, connections = variant.get_soc_with_connections()
+
+        async with semaphore:
+            await asyncio.to_thread(
+                prepare_zephyr_board_dir, board_name, soc_name, connections, workspace,
+                variant.fingerprint, variant.get_instance_connections()
+            )
+            async with build_lock:
+                start = time.perf_counter()
+                returncode, builds_dir = await build_zephyr_async(board_name, None, None, app_path, workspace,
+                                                                  graph_fingerprint=variant.fingerprint)
+                result["build_time"] = time.perf_counter() - start
+            if returncode != 0:
+                result["status"] = "build-failed"
+                return result
+
+            result["flash"], result["ram"] = footprint(builds_dir / "zephyr/zephyr.elf")
+            if await asyncio.to_thread(prepare_renode_files, board_name, workspace, templates_dir) != 0:
+                result["status"] = "simulation-failed"
+                return result
+
+            returncode, load = await _simulate_variant(board_name, workspace, duration,
+                                                       output_dir / f"{soc_name}.log")
+            result["status"] = "ok" if returncode == 0 else "simulation-failed"
+            result["cpu_load"] = load
+        return result
+
+    async def run_variant_safely(soc_name, soc_spec):
+        # One broken variant mustn't abort the sweep, its error is reported with the other results
+        result = {"soc": soc_name, "status": "incompatible"}
+        try:
+            return await run_variant(soc_name, soc_spec, result)
+        except Exception as e:
+            logging.error(f"Variant {soc_name} failed: {e}")
+            result["status"] = "error"
+            result["reason"] = str(e)
+            return result
+
+    async def run():
+        return await asyncio.gather(*(run_variant_safely(name, spec) for name, spec in sorted(candidates.items())))
+
+    results = asyncio.run(run())
+    report = output_dir / "report.json"
+    with open(report, "w") as f:
+        json.dump({"graph": graph.name, "duration": duration, "variants": results}, f, indent=4)
+
+    def fmt(value, unit="", precision=0):
+        return f"{value:.{precision}f}{unit}" if value is not None else "-"
+
+    print(f"{'SoC':<24} {'status':<18} {'flash':>10} {'RAM':>10} {'build':>8} {'CPU load':>9}")
+    ok = sorted((r for r in results if r["status"] == "ok"), key=lambda r: r["flash"])
+    for r in ok + [r for r in results if r["status"] != "ok"]:
+        print(f"{r['soc']:<24} {r['status']:<18} {fmt(r.get('flash'), ' B'):>10} {fmt(r.get('ram'), ' B'):>10} "
+              f"{fmt(r.get('build_time'), 's', 1):>8} {fmt(r.get('cpu_load'), ' %', 2):>9}")
+    print(f"{len(ok)}/{len(results)} SoCs ported successfully. Report saved in {report}")
@@ -3,6 +3,9 @@
 
 from __future__ import annotations
 import asyncio
+import collections
+import contextlib
+import contextvars
 import functools
 import json
 import logging
@@ -10,15 +13,21 @@ import os
 import re
 import signal
 import sys
+import time
 
+from concurrent.futures import ThreadPoolExecutor
 from typing import Dict
 from pipeline_manager_backend_communication.communication_backend import CommunicationBackend
 from pipeline_manager_backend_communication.misc_structures import MessageType
 
 from . import build
 from . import simulate
+from .affinity import partition_cpus, pin_process
+from .build_db import BuildDatabase, collect_build_inputs
+from .checkpoints import CheckpointStore
+from .workspace_gc import gc_policy
 from .specification import Specification
-from .parse_graph import Graph
+from .parse_graph import Graph, THERMOMETER_RDP_NAMES, live_changes
 
 
 class RPCMethods:
@@ -49,6 +58,27 @@ class RPCMethods:
         await self.vsd_client.send_progress("dataflow_run", -1)
         return await self.vsd_client.handle_run(dataflow)
 
+    async def simulation_pause(self) -> Dict:
+        return await self.vsd_client.handle_simulation_control("pause")
+
+    async def simulation_resume(self) -> Dict:
+        return await self.vsd_client.handle_simulation_control("resume")
+
+    async def simulation_step(self, seconds: float = 0.1) -> Dict:
+        return await self.vsd_client.handle_simulation_control("step", seconds)
+
+    async def simulation_speed(self, factor: float = None) -> Dict:
+        return await self.vsd_client.handle_simulation_control("set_speed", factor)
+
+    async def simulation_seek(self, time: float) -> Dict:
+        return await self.vsd_client.handle_seek(time)
+
+    async def simulation_reload_firmware(self) -> Dict:
+        return await self.vsd_client.handle_reload_firmware()
+
+    def terminal_read(self, name: str, message: str) -> Dict:
+        return self.vsd_client.handle_terminal_input(name, message)
+
     def dataflow_stop(self, method: str) -> Dict:
         match method:
             case "dataflow_run":
@@ -60,36 +90,208 @@ class RPCMethods:
         return self.vsd_client._ok("Stopped.")
 
 
+class TerminalInput():
+    """
+    Forwards input typed in the frontend terminal to the UART.
+
+    Keystrokes received in the same iteration of the event loop are sent
+    as one batch. Batches are written by a single worker thread, so they
+    keep their order and the event loop isn't blocked.
+    """
+    def __init__(self, uart, loop):
+        self.injector = simulate.UARTInjector(uart)
+        self._loop = loop
+        self._buffer = bytearray()
+        self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="vsd-uart-input")
+
+    def feed(self, text):
+        if not self._buffer:
+            self._loop.call_soon(self._flush)
+        self._buffer.extend(text.encode())
+
+    def _flush(self):
+        data = bytes(self._buffer)
+        self._buffer.clear()
+        self._executor.submit(self.injector.write, data)
+
+    def close(self):
+        self._executor.shutdown(wait=False)
+        logging.debug(f"Terminal input: {self.injector.stats()}")
+
+
+# Session handling the current RPC request, used to route log messages
+current_session = contextvars.ContextVar("current_session", default=None)
+
+
+class FairScheduler():
+    """
+    Limits the number of concurrent jobs. Waiting sessions are served in
+    round-robin order, so a session queueing many jobs can't starve others.
+    """
+    def __init__(self, slots):
+        self.slots = slots
+        self.running = 0
+        self._waiting = collections.OrderedDict()
+
+    def _grant(self):
+        while self.running < self.slots and self._waiting:
+            session, queue = self._waiting.popitem(last=False)
+            while queue and queue[0].cancelled():
+                queue.popleft()
+            if not queue:
+                continue
+            future = queue.popleft()
+            # The session goes to the end of the round
+            if queue:
+                self._waiting[session] = queue
+            self.running += 1
+            future.set_result(None)
+
+    async def acquire(self, session):
+        if self.running < self.slots and not self._waiting:
+            self.running += 1
+            return
+
+        future = asyncio.get_running_loop().create_future()
+        self._waiting.setdefault(session, collections.deque()).append(future)
+        try:
+            await future
+        except asyncio.CancelledError:
+            if future.done() and not future.cancelled():
+                self.release()
+            raise
+
+    def release(self):
+        self.running -= 1
+        self._grant()
+
+    @contextlib.asynccontextmanager
+    async def slot(self, session):
+        await self.acquire(session)
+        try:
+            yield
+        finally:
+            self.release()
+
+
+class SharedResources():
+    """
+    State shared by all sessions served by the backend process: the specification,
+    Renode emulation (all simulations are machines in it) and job schedulers.
+    """
+    def __init__(self, workspace, build_slots=1, simulation_slots=4, scratch=None, preempt="pause",
+                 build_cpus=None):
+        self.specification = Specification(workspace / "visual-system-designer-resources/components-specification.json")
+        self.adjust_specifiaction()
+        self.teardown = simulate.TeardownWorker()
+        self.builds = FairScheduler(build_slots)
+        self.simulations = FairScheduler(simulation_slots)
+        self.scratch = scratch
+        self.preempt = preempt
+        self.build_cpus = build_cpus
+        self.sessions = []
+        self._machine_count = 0
+
+    def machine_name(self, board_name):
+        # Each run gets its own machine, so it doesn't have to wait for removal of the previous one.
+        self._machine_count += 1
+        return f"{board_name}-{self._machine_count}"
+
+    def other_simulations(self, session):
+        return [s for s in self.sessions if s is not session and s.simulation is not None]
+
+    def adjust_specifiaction(self):
+        # Add property for LEDs indicating if they are active
+        for node in self.specification.spec_json["nodes"]:
+            if "category" not in node:
+                continue
+            if node["category"] == "IO/LED":
+                node["properties"].append(
+                    {
+                        "default": False,
+                        "name": "active",
+                        "type": "bool"
+                    }
+                )
+                node["properties"].append(
+                    {
+                        "default": True,
+                        "name": "observed",
+                        "type": "bool"
+                    }
+                )
+            if node.get("urls", {}).get("rdp", "").split("/")[-1] in THERMOMETER_RDP_NAMES:
+                node.setdefault("properties", []).append(
+                    {
+                        "default": 25.0,
+                        "name": "temperature",
+                        "type": "number"
+                    }
+                )
+
+        # Set custom buttons on navigation bar
+        if "navbarItems" not in self.specification.spec_json["metadata"]:
+            self.specification.spec_json["metadata"]["navbarItems"] = [
+                {
+                    "name": "Build",
+                    "iconName": "build.svg",
+                    "procedureName": "custom_build"
+                },
+                {
+                    "name": "Run simulation",
+                    "iconName": "Run",
+                    "procedureName": "dataflow_run"
+                },
+            ]
+
+
 class VSDLogHandler(logging.Handler):
-    def __init__(self, vsd_client: VSDClient):
+    """Sends log messages to the session which caused them, or to all sessions if it's unknown."""
+    def __init__(self, shared: SharedResources):
         super().__init__()
         self.formatter = logging.Formatter(fmt='%(levelname)s: %(message)s\n')
-        self.vsd_client = vsd_client
+        self.shared = shared
 
     def filter(self, record):
         return record.module != 'dts2repl'
 
     def emit(self, record):
-        if self.vsd_client._client.connected:
-            msg = self.formatter.format(record)
-            self.vsd_client.terminal_write_sync("backend-logs", msg)
+        session = current_session.get()
+        msg = self.formatter.format(record)
+        for vsd_client in self.shared.sessions:
+            if vsd_client._client.connected and session in (None, vsd_client):
+                vsd_client.terminal_write_sync("backend-logs", msg)
 
 
 class VSDClient:
-    def __init__(self, host, port, workspace, app, templates_dir):
-        self.specification = Specification(workspace / "visual-system-designer-resources/components-specification.json")
-        self.adjust_specifiaction()
+    """Session of a single Pipeline Manager instance, with its own graphs, jobs and terminals."""
+    def __init__(self, host, port, workspace, app, templates_dir, shared, name=None,
+                 checkpoint_interval=None, checkpoint_budget=1 << 30):
+        self.shared = shared
+        self.name = name
+        self.specification = shared.specification
         self.workspace = workspace
         self.app = app
         self.templates = templates_dir
         self.stop_simulation_event = asyncio.Event()
         self.stop_build_event = asyncio.Event()
+        self.simulation = None
+        self.simulation_board = None
+        self.simulation_graph = None
+        self.simulation_dts = None
+        self.observed_leds = set()
+        self.terminal_inputs = {}
+        self.teardown = shared.teardown
+        self._stopped_at = None
+        self.checkpoint_interval = checkpoint_interval
+        self.checkpoint_budget = checkpoint_budget
         self._client = CommunicationBackend(host, port)
 
     async def start_listening(self):
+        # Requests are handled in tasks created from this one, so they inherit the session
+        current_session.set(self)
         await self._client.initialize_client(RPCMethods(self))
-        logging.info("Start listening for messages from pipeline manager")
-        logging.getLogger().addHandler(VSDLogHandler(self))
+        logging.info(f"Start listening for messages from pipeline manager{f' ({self.name})' if self.name else ''}")
         await self._client.start_json_rpc_client()
 
     def _error(self, msg):
@@ -136,35 +338,6 @@ class VSDClient:
             'content': msg
         }
 
-    def adjust_specifiaction(self):
-        # Add property for LEDs indicating if they are active
-        for node in self.specification.spec_json["nodes"]:
-            if "category" not in node:
-                continue
-            if node["category"] == "IO/LED":
-                node["properties"].append(
-                    {
-                        "default": False,
-                        "name": "active",
-                        "type": "bool"
-                    }
-                )
-
-        # Set custom buttons on navigation bar
-        if "navbarItems" not in self.specification.spec_json["metadata"]:
-            self.specification.spec_json["metadata"]["navbarItems"] = [
-                {
-                    "name": "Build",
-                    "iconName": "build.svg",
-                    "procedureName": "custom_build"
-                },
-                {
-                    "name": "Run simulation",
-                    "iconName": "Run",
-                    "procedureName": "dataflow_run"
-                },
-            ]
-
     def handle_specification_get(self):
         return self._ok(self.specification.spec_json)
 
@@ -175,6 +348,8 @@ class VSDClient:
             node_id = led.id
             if not (graph_id and node_id):
                 return
+            if node_id not in self.observed_leds:
+                return
             request = {
                 'graph_id': graph_id,
                 'node_id': node_id,
@@ -201,9 +376,89 @@ class VSDClient:
 
         return terminal_callback
 
+    def apply_live_changes(self, graph, changes):
+        """Apply changes of properties which don't affect the firmware to the running simulation."""
+        _, connections = graph.get_soc_with_connections()
+        soc_interfaces = {node.id: soc_if for soc_if, _, node in connections}
+
+        for node, name, value in changes:
+            logging.info(f"Setting {name} of {node.label} to {value}")
+            match name:
+                case 'observed':
+                    if value:
+                        self.observed_leds.add(node.id)
+                    else:
+                        self.observed_leds.discard(node.id)
+                case 'temperature':
+                    if node.id not in soc_interfaces:
+                        logging.warning(f"{node.label} isn't connected to the SoC, skipping.")
+                        continue
+                    repl_label = re.sub("_", "", node.label)
+                    simulate.set_temperature(
+                        self.simulation.machine, soc_interfaces[node.id], repl_label, value
+                    )
+
+    def update_running_simulation(self, graph):
+        """
+        Try to apply the graph to the running simulation.
+        Returns False if the changes affect the firmware and it has to be rebuilt.
+        """
+        if graph.fingerprint != self.simulation_graph.fingerprint:
+            return False
+
+        self.apply_live_changes(graph, live_changes(self.simulation_graph, graph))
+        self.simulation_graph = graph
+        return True
+
+    def _connect_machine(self, machine, graph, dts_path):
+        """Register terminal and LED callbacks on the machine peripherals."""
+        zephyr_console = simulate._find_chosen('zephyr,console', dts_path)
+
+        terminal_inputs = {}
+        for uart, uart_name in simulate.get_all_uarts(machine):
+            if uart_name == zephyr_console:
+                term_name = f"zephyr-console ({uart_name})"
+            else:
+                term_name = uart_name
+
+            simulate.register_uart_callback(
+                uart,
+                self.create_terminal_callback(term_name)
+            )
+            terminal_inputs[term_name] = TerminalInput(uart, asyncio.get_running_loop())
+
+        # Register leds callbacks
+        _, connections = graph.get_soc_with_connections()
+
+        for source, connection, dest in connections:
+            if connection == 'gpio':
+                repl_label = re.sub("_", "", dest.label)
+                logging.info(f"Connecting state observer to {dest.label} ({repl_label})")
+                simulate.register_led_callback(
+                    machine, source, repl_label,
+                    self.create_led_callback(graph.id, dest)
+                )
+
+        self.observed_leds = {
+            node.id for _, _, node in connections
+            if node.category.startswith("IO/LED") and node.get_property('observed', True)
+        }
+        return terminal_inputs
+
     async def handle_run(self, graph_json):
+        requested_at = time.perf_counter()
         graph = Graph(graph_json, self.specification)
 
+        if self.simulation is not None:
+            try:
+                if self.update_running_simulation(graph):
+                    return self._ok("Changes applied to the running simulation.")
+            except Exception as e:
+                logging.error(f"Failed to apply changes to the running simulation: {e}")
+                return self._error("Simulation update failed.")
+            logging.error("Graph changes affect the firmware. Build it and restart the simulation.")
+            return self._error("Simulation is already running.")
+
         board_name = re.sub('\s', '_', graph.name)
         build_dir = self.workspace / 'builds' / board_name
         repl_path = build_dir / (board_name + '.repl')
@@ -218,79 +473,231 @@ class VSDClient:
             logging.error(f"There is no {elf_path.name}. Did you forget to build the app?")
             return self._error("Simulation failed.")
 
+        if self.shared.simulations.running >= self.shared.simulations.slots:
+            logging.info("All simulation slots are in use, waiting for a free one.")
+        async with self.shared.simulations.slot(self):
+            return await self._run_simulation(graph, board_name, requested_at)
+
+    async def _run_simulation(self, graph, board_name, requested_at):
+        build_dir = self.workspace / 'builds' / board_name
+        repl_path = build_dir / (board_name + '.repl')
+        elf_path = build_dir / 'zephyr/zephyr.elf'
+        dts_path = build_dir / 'zephyr/zephyr.dts'
+        machine_name = self.shared.machine_name(board_name)
+
         try:
-            emu, machine = simulate.prepare_simulation(board_name, elf_path, repl_path)
+            emu, machine = simulate.prepare_simulation(
+                board_name, elf_path, repl_path, machine_name=machine_name
+            )
         except Exception as e:
             logging.error(f"Simulation can't be prepared using {repl_path} and {elf_path}:\n\t{e}")
             return self._error("Simulation failed.")
 
-        zephyr_console = simulate._find_chosen('zephyr,console', dts_path)
+        try:
+            terminal_inputs = self._connect_machine(machine, graph, dts_path)
+        except Exception as e:
+            logging.error(str(e))
+            self.teardown.remove(emu, machine, machine_name)
+            return self._error("Simulation failed.")
 
-        for uart, uart_name in simulate.get_all_uarts(machine):
-            if uart_name == zephyr_console:
-                term_name = f"zephyr-console ({uart_name})"
-            else:
-                term_name = uart_name
+        db = BuildDatabase(self.workspace)
+        lease = db.acquire_lease(build_dir)
+        try:
+            checkpoints = None
+            if self.checkpoint_interval and self.shared.other_simulations(self):
+                # Checkpoints contain the whole emulation, so they are taken only when it's not shared
+                logging.warning("Other sessions are simulating, checkpoints are disabled for this run.")
+            elif self.checkpoint_interval:
+                checkpoints = CheckpointStore(build_dir / 'checkpoints', self.checkpoint_interval, self.checkpoint_budget)
+                checkpoints.clear()
+
+            # Checkpoints of other sessions would contain this simulation too
+            # and their speed limits would apply to it as well
+            for other in self.shared.other_simulations(self):
+                if other.simulation.checkpoints:
+                    logging.warning(f"Checkpoints of the simulation on {other.simulation_board} are disabled.")
+                    await asyncio.to_thread(other.simulation.stop_checkpoints)
+                if other.simulation.speed != 1.0:
+                    logging.warning(f"Speed of the simulation on {other.simulation_board} is reset to 1x.")
+                    await asyncio.to_thread(other.simulation.set_speed, 1.0)
+
+            logging.info(f"Starting simulation on {board_name}.")
+            if not self.shared.other_simulations(self):
+                simulate.reset_emulation_settings(emu)
+            self.simulation = simulate.SimulationControl(emu, machine, machine_name, checkpoints)
+            self.simulation_board = board_name
+            self.simulation_dts = dts_path
+            self.simulation_graph = graph
+            self.terminal_inputs = terminal_inputs
+
+            try:
+                self.apply_live_changes(graph, live_changes(None, graph))
+            except Exception as e:
+                logging.warning(f"Failed to set initial simulation environment: {e}")
+
+            self.simulation.start()
+
+            started_at = time.perf_counter()
+            logging.info(f"Simulation started in {started_at - requested_at:.3f}s")
+            if self._stopped_at is not None:
+                logging.debug(f"Stop-to-start latency: {started_at - self._stopped_at:.3f}s")
+
+            await self.stop_simulation_event.wait()
+            self._stopped_at = time.perf_counter()
+            # Driver thread finishes its slice of virtual time first
+            await asyncio.to_thread(self.simulation.close)
+            # Emulation might have been replaced when restoring a checkpoint
+            emu, machine = self.simulation.emu, self.simulation.machine
+            self.simulation = None
+            self.simulation_board = None
+            self.simulation_graph = None
+            for terminal in self.terminal_inputs.values():
+                terminal.close()
+            self.terminal_inputs = {}
+            self.teardown.remove(emu, machine, machine_name)
+        finally:
+            db.release_lease(lease)
+            db.close()
 
-            simulate.register_uart_callback(
-                uart,
-                self.create_terminal_callback(term_name)
-            )
+        self.stop_simulation_event.clear()
 
-        # Register leds callbacks
+        logging.info(f"Simulation on {board_name} ended.")
+        return self._ok("Simulation finished.")
+
+    def _check_emulation_owner(self, action):
+        """Virtual time and state of the emulation are shared by all sessions."""
+        if self.shared.other_simulations(self):
+            logging.error(f"Can't {action} while other sessions are simulating, it would affect their simulations.")
+            return False
+        return True
+
+    async def handle_simulation_control(self, action, *args):
+        if self.simulation is None:
+            return self._error("There is no running simulation.")
+        if action in ("step", "set_speed") and not self._check_emulation_owner(action.replace('_', ' ')):
+            return self._error("Simulation control failed.")
+
+        # The simulation can be stopped while the action runs
+        simulation = self.simulation
+        # Stepping blocks until the requested virtual time passes, so don't run it in the event loop.
+        # Threads of asyncio.to_thread keep the session context, so their logs reach only this session.
         try:
-            _, connections = graph.get_soc_with_connections()
-        except KeyError as e:
-            logging.error(str(e))
-            return self._error("Simulation failed.")
+            await asyncio.to_thread(getattr(simulation, action), *args)
+        except Exception as e:
+            logging.error(f"Failed to {action.replace('_', ' ')}: {e}")
+            return self._error("Simulation control failed.")
+
+        state = "paused" if simulation.paused else "running"
+        speed = f"{simulation.speed}x" if simulation.speed else "unlimited"
+        return self._ok(f"Simulation {state} at {simulation.virtual_time():.3f}s (speed: {speed}).")
+
+    async def handle_seek(self, virtual_time):
+        if self.simulation is None:
+            return self._error("There is no running simulation.")
+        if not self._check_emulation_owner("seek"):
+            return self._error("Seek failed.")
 
         try:
-            for source, connection, dest in connections:
-                if connection == 'gpio':
-                    repl_label = re.sub("_", "", dest.label)
-                    logging.info(f"Connecting state observer to {dest.label} ({repl_label})")
-                    simulate.register_led_callback(
-                        machine, source, repl_label,
-                        self.create_led_callback(graph.id, dest)
-                    )
+            await asyncio.to_thread(self.simulation.seek, virtual_time)
+            # Callbacks aren't saved in checkpoints, so they have to be registered again
+            for terminal in self.terminal_inputs.values():
+                terminal.close()
+            self.terminal_inputs = self._connect_machine(
+                self.simulation.machine, self.simulation_graph, self.simulation_dts
+            )
+            self.apply_live_changes(self.simulation_graph, live_changes(None, self.simulation_graph))
         except Exception as e:
-            logging.error(str(e))
-            emu.clear()
-            return self._error("Simulation failed.")
+            logging.error(f"Failed to seek to {virtual_time}s: {e}")
+            return self._error("Seek failed.")
 
-        logging.info(f"Starting simulation on {board_name}.")
-        emu.StartAll()
+        return self._ok(f"Simulation paused at {self.simulation.virtual_time():.3f}s.")
 
-        await self.stop_simulation_event.wait()
-        emu.clear()
+    async def handle_reload_firmware(self):
+        if self.simulation is None:
+            return self._error("There is no running simulation.")
 
-        self.stop_simulation_event.clear()
+        elf_path = self.workspace / 'builds' / self.simulation_board / 'zephyr/zephyr.elf'
+        if not elf_path.exists():
+            logging.error(f"There is no {elf_path.name}. Did you forget to build the app?")
+            return self._error("Firmware reload failed.")
 
-        logging.info(f"Simulation on {board_name} ended.")
-        return self._ok("Simulation finished.")
+        try:
+            await asyncio.to_thread(self.simulation.reload_firmware, elf_path)
+        except Exception as e:
+            logging.error(f"Failed to reload firmware: {e}")
+            return self._error("Firmware reload failed.")
+
+        return self._ok("Firmware reloaded.")
+
+    def handle_terminal_input(self, term_name, message):
+        if term_name not in self.terminal_inputs:
+            return self._error(f"Terminal {term_name} isn't connected to the simulation.")
+        self.terminal_inputs[term_name].feed(message)
+        return self._ok("")
 
     def handle_stop(self):
         self.stop_simulation_event.set()
         return self._ok("Stopping simulation")
 
+    def _app_unchanged(self, board_name):
+        """Check if inputs of the build haven't changed since the last successful build of the board."""
+        db = BuildDatabase(self.workspace)
+        try:
+            last = next((b for b in db.history(board_name) if b["status"] == "success"), None)
+            return last is not None and \
+                db.get_inputs(last["id"]) == collect_build_inputs(board_name, self.app, self.workspace)
+        finally:
+            db.close()
+
     async def handle_build(self, graph_json):
-        prepare_ret = self._prepare_build(graph_json)
+        if self.simulation is not None:
+            graph = Graph(graph_json, self.specification)
+            # Graph fingerprint doesn't cover sources of the application
+            if graph.name == self.simulation_board and \
+                    await asyncio.to_thread(self._app_unchanged, self.simulation_board):
+                try:
+                    if self.update_running_simulation(graph):
+                        logging.info("Graph changes don't affect the firmware, applied them to the running simulation.")
+                        return self._ok("Build skipped.")
+                except Exception as e:
+                    logging.error(f"Failed to apply changes to the running simulation: {e}")
+                    return self._error("Simulation update failed.")
+
+        if self.shared.builds.running >= self.shared.builds.slots:
+            logging.info("Waiting for builds of other sessions to finish.")
+        async with self.shared.builds.slot(self):
+            return await self._build(graph_json)
+
+    async def _build(self, graph_json):
+        # Preparing the board waits for other builds using it, so it can't block the event loop
+        prepare_ret = await asyncio.to_thread(self._prepare_build, graph_json)
         if not prepare_ret:
             return self._error("Build failed.")
 
-        board_dir, board_name, command = prepare_ret
+        board_dir, board_name, command, graph_fingerprint = prepare_ret
         logging.info(f"Zephyr board configuration prepared in: {board_dir}")
         logging.info(f"To build this demo manually use the following command:\n\t{command}")
 
         async def print_fun(msg):
             await self.terminal_write('backend-logs', msg)
 
+        # Platform of the previous build, used to check if the firmware can be swapped in running simulation
+        repl_path = self.workspace / 'builds' / board_name / f"{board_name}.repl"
+        old_repl = repl_path.read_text() if repl_path.exists() else None
+
         build_ret, build_dir = await build.build_zephyr_async(
             board_name,
             print_fun,
             self.stop_build_event,
             self.app,
-            self.workspace
+            self.workspace,
+            scratch=self.shared.scratch,
+            # Builds requested from the UI pause or cancel batch jobs running in the workspace
+            priority="interactive",
+            preempt=self.shared.preempt,
+            cpus=self.shared.build_cpus,
+            # Another session could regenerate the board from a graph with the same name
+            graph_fingerprint=graph_fingerprint,
         )
         self.stop_build_event.clear()
 
@@ -305,6 +712,17 @@ class VSDClient:
             logging.error("Failed to create files needed by Renode.")
             return self._error("Build failed.")
 
+        # Swap firmware of the running simulation, so it doesn't have to be restarted.
+        # It's possible only if the platform hasn't changed.
+        if self.simulation_board == board_name and old_repl != repl_path.read_text():
+            logging.warning("Platform has changed, restart the simulation to use the new firmware.")
+        elif self.simulation_board == board_name:
+            logging.info(f"Reloading firmware in running simulation on {board_name}")
+            reload_ret = await self.handle_reload_firmware()
+            if reload_ret['type'] == MessageType.ERROR.value:
+                logging.warning("Restart the simulation to use the new firmware.")
+                return self._ok("Build succeeded, firmware reload failed.")
+
         return self._ok("Build succeeded.")
 
     def _prepare_build(self, graph_json):
@@ -314,12 +732,15 @@ class VSDClient:
         soc_name = soc.rdp_name
         board_name = re.sub('\s', '_', graph.name)
 
-        board_dir = build.prepare_zephyr_board_dir(board_name, soc_name, connections, self.workspace)
+        board_dir = build.prepare_zephyr_board_dir(
+            board_name, soc_name, connections, self.workspace, graph.fingerprint,
+            graph.get_instance_connections()
+        )
         if not board_dir:
             None
 
         command = build.compose_west_command(board_name, self.app, "<build-dir>", self.workspace)
-        return board_dir, board_name, command
+        return board_dir, board_name, command, graph.fingerprint
 
     def save_graph(self, graph_json):
         graph = Graph(graph_json, self.specification)
@@ -341,12 +762,27 @@ async def shutdown(loop):
     loop.stop()
 
 
-def start_vsd_backend(host, port, workspace, application, templates):
+def start_vsd_backend(host, ports, workspace, application, templates, gc_budget=None,
+                      checkpoint_interval=None, build_slots=1, simulation_slots=4, gc_interval=600,
+                      scratch=None, preempt="pause", sim_cpus=None, build_cpus=None):
     """
-    Initializes the client and runs its asyncio event loop until it is interrupted.
+    Initializes clients for all Pipeline Manager instances (one session per port)
+    and runs their asyncio event loop until it is interrupted.
     Doesn't return, if signal is caught whole process exits.
     """
-    client = VSDClient(host, port, workspace, application, templates)
+    # Simulations run in this process, builds in its subprocesses
+    sim_cpus, build_cpus = partition_cpus(sim_cpus, build_cpus)
+    if sim_cpus:
+        pin_process(sim_cpus)
+
+    shared = SharedResources(workspace, build_slots, simulation_slots, scratch, preempt, build_cpus)
+    for port in ports:
+        shared.sessions.append(VSDClient(
+            host, port, workspace, application, templates, shared,
+            name=f"session-{port}" if len(ports) > 1 else None,
+            checkpoint_interval=checkpoint_interval
+        ))
+    logging.getLogger().addHandler(VSDLogHandler(shared))
 
     loop = asyncio.get_event_loop()
 
@@ -354,7 +790,14 @@ def start_vsd_backend(host, port, workspace, application, templates):
         signal.SIGINT,
         functools.partial(asyncio.create_task, shutdown(loop))
     )
-    loop.run_until_complete(client.start_listening())
+
+    async def serve():
+        if gc_budget:
+            # The loop keeps only a weak reference to the task
+            gc_task = asyncio.create_task(gc_policy(workspace, gc_budget, gc_interval))
+        await asyncio.gather(*(client.start_listening() for client in shared.sessions))
+
+    loop.run_until_complete(serve())
 
     # After loop has ended, exit because there is no work to do.
     sys.exit(0)
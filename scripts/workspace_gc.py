@@ -0,0 +1,203 @@
+# Copyright (c) 2023 Antmicro
+# SPDX-License-Identifier: Apache-2.0
+
+import asyncio
+import contextlib
+import logging
+import os
+import re
+import shutil
+import time
+
+from pathlib import Path
+
+from .build_db import BuildDatabase, workspace_lock
+
+
+# Used when there is no record of how long it took to produce the entry.
+DEFAULT_REBUILD_COST = 60.0
+
+# Staging directories younger than that (in seconds) are never removed
+STAGING_MIN_AGE = 3600
+
+_SIZE_UNITS = {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30, "T": 1 << 40}
+
+
+def parse_size(size):
+    m = re.fullmatch(r"\s*(\d+(?:\.\d+)?)\s*([KMGT]?)i?B?\s*", str(size), re.IGNORECASE)
+    if not m:
+        raise ValueError(f"Invalid size: '{size}'")
+    return int(float(m.group(1)) * _SIZE_UNITS[m.group(2).upper()])
+
+
+def format_size(size):
+    for unit in ["B", "KiB", "MiB", "GiB"]:
+        if size < 1024:
+            return f"{size:.1f} {unit}"
+        size /= 1024
+    return f"{size:.1f} TiB"
+
+
+def _dir_size(path):
+    total = 0
+    for root, _, files in os.walk(path):
+        for name in files:
+            try:
+                total += os.lstat(os.path.join(root, name)).st_size
+            except FileNotFoundError:
+                pass
+    return total
+
+
+class GCEntry():
+    def __init__(self, path, kind, db):
+        self.path = Path(path).absolute()
+        self.kind = kind
+        self.size = _dir_size(self.path)
+        # Workspace lock held by processes writing the entry
+        self.lock = None
+
+        last_used = db.last_used(self.path)
+        self.last_used = max(last_used or 0, self.path.stat().st_mtime)
+
+        if kind == "build-tree":
+            # Warm trees (restored to the scratch space) only speed up the next build of the board
+            self.cost = db.rebuild_cost(self.path.parent / "builds" / self.path.name[len("build-"):]) or 0.0
+            self.lock = self.path.name
+        elif kind == "artifacts":
+            self.cost = db.rebuild_cost(self.path) or DEFAULT_REBUILD_COST
+            self.lock = f"build-{self.path.name}"
+        elif kind == "staging":
+            # Left by a process which died before publishing it
+            self.cost = 0.0
+        else:
+            self.cost = DEFAULT_REBUILD_COST
+
+    def score(self, now):
+        """Higher score means the entry should be evicted earlier."""
+        if self.kind == "staging":
+            return float("inf")
+        return (now - self.last_used) / (1.0 + self.cost)
+
+    def is_leased(self, leased_paths):
+        for leased in leased_paths:
+            leased = Path(leased)
+            if leased == self.path or self.path in leased.parents or leased in self.path.parents:
+                return True
+        return False
+
+
+def _staging_owner_alive(path):
+    # Staging directories are named <name>-<owner PID>-<random suffix>
+    m = re.search(r"-(\d+)-[^-]+$", path.name)
+    if not m:
+        return False
+    try:
+        os.kill(int(m.group(1)), 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+    return True
+
+
+def _is_abandoned(path):
+    try:
+        age = time.time() - path.stat().st_mtime
+    except FileNotFoundError:
+        return False
+    return age > STAGING_MIN_AGE and not _staging_owner_alive(path)
+
+
+def collect_gc_entries(workspace, db):
+    """Find all workspace entries that can be removed and recreated later."""
+    candidates = []
+
+    builds_dir = workspace / "builds"
+    if builds_dir.exists():
+        candidates += [(d, "artifacts") for d in builds_dir.iterdir() if d.is_dir()]
+
+    candidates += [(d, "build-tree") for d in workspace.glob("build-*") if d.is_dir()]
+    candidates += [(d, "build-tree") for d in workspace.glob("build") if d.is_dir()]
+
+    cache_dir = workspace / "cache"
+    if cache_dir.exists():
+        for cache in cache_dir.iterdir():
+            if cache.is_dir():
+                candidates += [(e, "cache") for e in cache.iterdir()]
+
+    staging = workspace / "staging"
+    if staging.exists():
+        candidates += [(d, "staging") for d in staging.iterdir() if _is_abandoned(d)]
+
+    entries = []
+    for path, kind in candidates:
+        try:
+            entries.append(GCEntry(path, kind, db))
+        except FileNotFoundError:
+            # Removed while collecting, e.g. replaced by a build
+            continue
+    return entries
+
+
+def collect_garbage(workspace, budget, dry_run=False):
+    """
+    Remove least recently used and cheapest to recreate entries until
+    the managed part of the workspace fits in the budget.
+    Returns the number of reclaimed bytes.
+    """
+    db = BuildDatabase(workspace)
+    entries = collect_gc_entries(workspace, db)
+    leased = db.leased_paths()
+    db.close()
+
+    total = sum(e.size for e in entries)
+    logging.info(f"Workspace builds and caches use {format_size(total)} (budget: {format_size(budget)})")
+    if total <= budget:
+        return 0
+
+    now = time.time()
+    reclaimed = 0
+    removed = 0
+    for entry in sorted(entries, key=lambda e: e.score(now), reverse=True):
+        if total - reclaimed <= budget:
+            break
+        if entry.is_leased(leased):
+            logging.debug(f"Skipping {entry.path}, it is in use")
+            continue
+
+        logging.info(f"{'Would remove' if dry_run else 'Removing'} {entry.kind} {entry.path} ({format_size(entry.size)})")
+        if not dry_run:
+            try:
+                with workspace_lock(workspace, entry.lock, blocking=False) if entry.lock else contextlib.nullcontext():
+                    shutil.rmtree(entry.path, ignore_errors=True)
+            except BlockingIOError:
+                logging.debug(f"Skipping {entry.path}, it is being built")
+                continue
+        reclaimed += entry.size
+        removed += 1
+
+    if total - reclaimed > budget:
+        logging.warning("Can't fit in the budget, remaining entries are in use.")
+
+    logging.info(f"Reclaimed {format_size(reclaimed)} from {removed} entries.")
+    return reclaimed
+
+
+async def gc_policy(workspace, budget, interval):
+    """Periodically collect garbage in the workspace without blocking the event loop."""
+    loop = asyncio.get_running_loop()
+    while True:
+        try:
+            await loop.run_in_executor(None, collect_garbage, workspace, budget)
+        except Exception as e:
+            logging.error(f"Garbage collection failed: {e}")
+        await asyncio.sleep(interval)
+
+
+def gc(budget: str = "10G",
+       workspace: Path = Path("workspace"),
+       dry_run: bool = False):
+    """Remove old builds and caches to keep the workspace in the disk budget."""
+    reclaimed = collect_garbage(workspace, parse_size(budget), dry_run)
+    print(f"Reclaimed {format_size(reclaimed)}{' (dry run)' if dry_run else ''}.")
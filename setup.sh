@@ -11,6 +11,8 @@ set -e
 : ${ZEPHYR_SDK_VERSION:=0.16.3}
 : ${ZEPHYR_SDK_INSTALL_DIR:=$HOME/zephyr-sdk-${ZEPHYR_SDK_VERSION}}
 : ${PYRENODE_ARCH_PKG:=$WORKSPACE/renode-latest.pkg.tar.xz}
+# Additional Zephyr revisions (space separated) set up next to the pinned one
+: ${ZEPHYR_REVISIONS:=}
 
 create_venv() {
   if [[ ! -d $VSDENV ]]; then
@@ -100,6 +102,30 @@ get_zephyr() {
   fi
 }
 
+get_zephyr_revisions() {
+  # Every revision is a worktree of the main Zephyr repository (sharing its objects)
+  # with its own west workspace. West modules are taken from the main workspace
+  # when they are at the same revision, so only changed modules are downloaded.
+  WORKSPACE_DIR=$(realpath $WORKSPACE)
+  for REVISION in $ZEPHYR_REVISIONS ; do
+    REVISION_DIR=$WORKSPACE_DIR/zephyr-revisions/$REVISION
+    if [[ -d $REVISION_DIR/.west ]] ; then
+      echo "INFO: Zephyr $REVISION found in $REVISION_DIR."
+      continue
+    fi
+    echo "INFO: Adding Zephyr $REVISION in $REVISION_DIR."
+    if [[ ! -d $REVISION_DIR/zephyr ]] ; then
+      git -C $WORKSPACE_DIR/zephyr fetch --depth 1 origin "$REVISION"
+      mkdir -p $REVISION_DIR
+      git -C $WORKSPACE_DIR/zephyr worktree add --detach $REVISION_DIR/zephyr FETCH_HEAD
+    fi
+    cd $REVISION_DIR
+    west init -l zephyr
+    west update --path-cache $WORKSPACE_DIR
+    cd - > /dev/null
+  done
+}
+
 get_zephyr_sdk() {
   if [[ -d ${ZEPHYR_SDK_INSTALL_DIR} ]] && [[ "$(cat ${ZEPHYR_SDK_INSTALL_DIR}/sdk_version)" == "${ZEPHYR_SDK_VERSION}" ]] ; then
     echo "INFO: Zephyr SDK found: ${ZEPHYR_SDK_INSTALL_DIR}"
@@ -118,12 +144,46 @@ get_zephyr_sdk() {
   cd $CWD
 }
 
+frontend_fingerprint() {
+  {
+    git -C $WORKSPACE/kenning-pipeline-manager rev-parse HEAD
+    git -C $WORKSPACE/kenning-pipeline-manager diff HEAD
+    # Untracked files aren't part of the diff, hash their contents separately
+    git -C $WORKSPACE/kenning-pipeline-manager status --porcelain --untracked-files=all
+    (cd $WORKSPACE/kenning-pipeline-manager && git ls-files -z --others --exclude-standard | sort -z | xargs -0 -r sha256sum)
+    (cd $WORKSPACE/visual-system-designer-resources/assets && find . -type f -print0 | sort -z | xargs -0 sha256sum)
+    node --version 2> /dev/null || true
+  } | sha256sum | cut -d ' ' -f 1
+}
+
 build_pipeline_manager() {
-  pipeline_manager build server-app \
-    --workspace-directory $WORKSPACE/.pipeline_manager/workspace \
-    --output-directory $WORKSPACE/.pipeline_manager/frontend \
-    --assets-directory $WORKSPACE/visual-system-designer-resources/assets \
-    --favicon-path $WORKSPACE/visual-system-designer-resources/assets/visual-system-designer.svg
+  FRONTEND_DIR=$WORKSPACE/.pipeline_manager/frontend
+  FINGERPRINT=$(frontend_fingerprint)
+  FRONTEND_CACHE=$WORKSPACE/cache/frontend/$FINGERPRINT
+
+  if [[ -d $FRONTEND_DIR ]] && [[ "$(cat $FRONTEND_DIR.fingerprint 2> /dev/null)" == "$FINGERPRINT" ]] ; then
+    echo "INFO: Pipeline Manager frontend is up to date."
+    return
+  fi
+
+  if [[ -d $FRONTEND_CACHE ]] ; then
+    echo "INFO: Restoring Pipeline Manager frontend from $FRONTEND_CACHE."
+    rm -rf $FRONTEND_DIR
+    mkdir -p $(dirname $FRONTEND_DIR)
+    cp -r $FRONTEND_CACHE $FRONTEND_DIR
+  else
+    pipeline_manager build server-app \
+      --workspace-directory $WORKSPACE/.pipeline_manager/workspace \
+      --output-directory $FRONTEND_DIR \
+      --assets-directory $WORKSPACE/visual-system-designer-resources/assets \
+      --favicon-path $WORKSPACE/visual-system-designer-resources/assets/visual-system-designer.svg
+    # Copy under temporary name, so interrupted setup doesn't leave incomplete cache entry
+    mkdir -p $(dirname $FRONTEND_CACHE)
+    rm -rf $FRONTEND_CACHE.tmp
+    cp -r $FRONTEND_DIR $FRONTEND_CACHE.tmp
+    mv $FRONTEND_CACHE.tmp $FRONTEND_CACHE
+  fi
+  echo $FINGERPRINT > $FRONTEND_DIR.fingerprint
 }
 
 get_renode_arch_pkg() {
@@ -154,6 +214,7 @@ EOF
 get_dependencies
 install_requirements
 get_zephyr
+get_zephyr_revisions
 get_zephyr_sdk
 build_pipeline_manager
 get_renode_arch_pkg
@@ -15,8 +15,15 @@ from time import sleep
 
 from pipeline_manager.scripts.run import script_run as pm_main
 from scripts.build import build_zephyr, prepare_zephyr_board
+from scripts.build_db import build_history
+from scripts.bundle import export_bundle, import_bundle
+from scripts.coverage import coverage_report
+from scripts.scratch import ScratchSpace
 from scripts.vsd_backend import start_vsd_backend
 from scripts.simulate import prepare_renode_files, simulate
+from scripts.sim_shards import simulate_shards
+from scripts.sweep import sweep
+from scripts.workspace_gc import gc, parse_size
 
 app = typer.Typer(no_args_is_help=True, add_completion=False)
 
@@ -28,6 +35,23 @@ app.command()(prepare_renode_files)
 
 app.command()(simulate)
 
+app.command()(build_history)
+
+app.command()(gc)
+
+app.command()(coverage_report)
+
+app.command()(simulate_shards)
+
+app.command()(export_bundle)
+
+app.command()(import_bundle)
+
+app.command()(sweep)
+
+# Commands which work with build results only, e.g. on a simulation host
+ZEPHYR_FREE_COMMANDS = ("simulate", "import-bundle", "export-bundle", "build-history", "gc", "simulate-shards")
+
 @app.command("run")
 def start_vsd_app(application: Path = Path("demo/blinky-temperature"),
                   workspace: Path = Path("workspace"),
@@ -36,35 +60,64 @@ def start_vsd_app(application: Path = Path("demo/blinky-temperature"),
                   website_port: int = 9000,
                   vsd_backend_host: str = "127.0.0.1",
                   vsd_backend_port: int = 5000,
+                  gc_budget: str = None,
+                  checkpoint_interval: float = None,
+                  sessions: int = 1,
+                  build_slots: int = 1,
+                  simulation_slots: int = 4,
+                  scratch_dir: Path = None,
+                  scratch_budget: str = None,
+                  preempt: str = "pause",
+                  sim_cpus: str = None,
+                  build_cpus: str = None,
                   verbosity: str = "INFO"):
+    """
+    Start VSD application. With --sessions N, N Pipeline Manager instances are
+    started on consecutive ports, all served by a single backend process.
+    With --scratch-dir, build trees are kept there (see build-zephyr).
+    --preempt (pause, cancel, none) is applied to lower priority jobs during builds.
+    --sim-cpus and --build-cpus (e.g. 0-3) separate simulations from builds.
+    """
 
     logging.basicConfig(level=verbosity, format="%(levelname)s:VSD backend:\t%(message)s")
 
     frontend_dir = workspace / ".pipeline_manager/frontend"
     app_workspace = workspace / ".pipeline_manager/workspace"
 
-    pm_args = (
-        "pipeline_manager",  # The first argument must be a program name.
-        "--frontend-directory", str(frontend_dir),
-        '--workspace-directory', str(app_workspace),
-        "--backend-host", website_host,
-        "--backend-port", str(website_port),
-        "--tcp-server-host", vsd_backend_host,
-        "--tcp-server-port", str(vsd_backend_port),
-        "--verbosity", "INFO",
-    )
-    pm_proc = Process(target=pm_main, args=[pm_args])
-    pm_proc.start()
+    pm_procs = []
+    for i in range(sessions):
+        pm_args = (
+            "pipeline_manager",  # The first argument must be a program name.
+            "--frontend-directory", str(frontend_dir),
+            '--workspace-directory', str(app_workspace if sessions == 1 else app_workspace / f"session-{i}"),
+            "--backend-host", website_host,
+            "--backend-port", str(website_port + i),
+            "--tcp-server-host", vsd_backend_host,
+            "--tcp-server-port", str(vsd_backend_port + i),
+            "--verbosity", "INFO",
+        )
+        pm_proc = Process(target=pm_main, args=[pm_args])
+        pm_proc.start()
+        pm_procs.append(pm_proc)
+        if sessions > 1:
+            logging.info(f"Session {i} available at http://{website_host}:{website_port + i}")
 
     def wait_for_pm():
-        pm_proc.join()
+        for pm_proc in pm_procs:
+            pm_proc.join()
         logging.info("Pipeline manager server closed. Exiting...")
 
     atexit.register(wait_for_pm)
     sleep(0.5)
 
     # XXX: This function won't return.
-    start_vsd_backend(vsd_backend_host, vsd_backend_port, workspace, application, templates_dir)
+    ports = [vsd_backend_port + i for i in range(sessions)]
+    scratch = ScratchSpace(workspace, scratch_dir, parse_size(scratch_budget) if scratch_budget else None) \
+        if scratch_dir else None
+    start_vsd_backend(vsd_backend_host, ports, workspace, application, templates_dir,
+                      parse_size(gc_budget) if gc_budget else None, checkpoint_interval,
+                      build_slots, simulation_slots, scratch=scratch, preempt=preempt,
+                      sim_cpus=sim_cpus, build_cpus=build_cpus)
 
 
 if __name__ == "__main__":
@@ -76,7 +129,8 @@ if __name__ == "__main__":
         logging.error("Not running in the VSD virtualenv. Please setup environment first.")
         sys.exit(1)
 
-    if 'ZEPHYR_BASE' not in os.environ or os.environ["ZEPHYR_BASE"] == "":
+    zephyr_needed = len(sys.argv) < 2 or sys.argv[1] not in ZEPHYR_FREE_COMMANDS
+    if zephyr_needed and ('ZEPHYR_BASE' not in os.environ or os.environ["ZEPHYR_BASE"] == ""):
         logging.error("ZEPHYR_BASE not defined. Please setup environment first.")
         sys.exit(1)
 